@@ -8,15 +8,30 @@
 //
 // Usage:
 //
-//  ./check_registers [notag] [expect] [list of testcases]
+//  ./check_registers [-jN] [inproc] [notag] [expect] [tsv|json]
+//                    [baseline=FILE] [list of testcases]
+//  ./check_registers bench [list of testcases]
 //
 // By default, the program runs all the tests with tagging enabled and without
 // printing the test expectations. Extra arguments are:
+//  - -jN: run up to N subprocesses at once (default: the number of CPUs); the
+//    results are still printed in the order of the test cases;
+//  - inproc: run the tests in a single subprocess that recovers from faults,
+//    forking a new one only when a test leaves it unusable (-jN is ignored);
+//  - tsv, json: print the results, with the time each test case took, as
+//    tab-separated values or as JSON instead of text;
+//  - baseline=FILE: compare with the TSV output of an earlier run on the same
+//    CPU model and mode, only re-running the test cases that failed, are new
+//    or have changed, and exit with an error if any result differs;
+//  - bench: instead of checking the tests, time the data flow tests with
+//    tagging disabled and enabled, through untagged and tagged pointers, for
+//    every tag width supported by the kernel (see run_bench());
 //  - notag: pass non-tagged pointers to the functions (all tests must pass);
 //  - expect: print tags expectations for the case tagging is enabled;
 //  - list of testcases: a space-separated list of tests to run.
 //
-// There currently are 6 types of test cases in two groups.
+// There currently are 6 types of register test cases in two groups, and the
+// instruction tests (see INSN_TESTS).
 // Data flow tests (expected to PASS with tagging enabled):
 //  - mov_$seg_$reg - performs 'movq $seg:(%$reg), %rbx',
 //  - movaps_$seg_$reg - performs 'movaps $seg:(%$reg), %xmm0',
@@ -39,16 +54,24 @@
 //  segment prefixes.
 
 #include <asm/prctl.h>
+#include <cpuid.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <set>
 #include <string>
+#include <vector>
 
 #define ARCH_GET_UNTAG_MASK 0x4001
 #define ARCH_ENABLE_TAGGED_ADDR 0x4002
@@ -61,11 +84,14 @@ __thread int ti[1024];
 
 int tag_bits;
 uint64_t tag_mask;
+// Informational messages go to stderr when printing TSV or JSON.
+std::ostream *info = &std::cout;
 void *tagged_addr, *tagged_offset, *tagged_jump;
 
-// Try to enable memory tagging for the process. Depending on @force, in the
-// case of a failure, either proceed without tags or bail out.
-bool try_enable_tagging(bool force) {
+// Try to enable memory tagging for the process, with at most @max_bits tag
+// bits. Depending on @force, in the case of a failure, either proceed without
+// tags or bail out.
+bool try_enable_tagging(bool force, int max_bits = 6) {
   int err = arch_prctl(ARCH_GET_MAX_TAG_BITS, &tag_bits, 0, 0, 0);
   if (err) {
     if (!force) return false;
@@ -73,7 +99,7 @@ bool try_enable_tagging(bool force) {
     exit(EXIT_FAILURE);
   }
 
-  tag_bits = std::min(tag_bits, 6);
+  tag_bits = std::min(tag_bits, max_bits);
   int ret = arch_prctl(ARCH_ENABLE_TAGGED_ADDR, tag_bits, 0, 0, 0);
 
   if (ret) {
@@ -90,9 +116,9 @@ bool try_enable_tagging(bool force) {
     exit(EXIT_FAILURE);
   }
 
-  std::cout << "Successfully enabled memory tagging.\n";
-  std::cout << "  Tag bits: " << tag_bits << "\n";
-  std::cout << "  Tag mask: " << (void *)tag_mask << "\n";
+  *info << "Successfully enabled memory tagging.\n";
+  *info << "  Tag bits: " << tag_bits << "\n";
+  *info << "  Tag mask: " << (void *)tag_mask << "\n";
   return true;
 }
 
@@ -212,6 +238,78 @@ FN_TEST_REG(rsi)
 FN_TEST_REG_NOCALL(rsp)
 FN_TEST_REG(rbp)
 
+// Instruction tests: X(name, CPU feature, asm, clobbers...) performs asm with
+// the tagged pointer in %0. The feature is a __builtin_cpu_supports() name, or
+// "" if the instruction is always available. These are the loads, stores and
+// hints used by SIMD loops, string functions and lock-free code, beyond the
+// plain mov and movaps of the tests above; all access memory via %ds, and are
+// expected to pass with tagging enabled. Note that prefetches never fault, so
+// they pass whether or not the tag is ignored. The opmask registers cannot be
+// listed as clobbered unless building for AVX-512, and the compiler does not
+// use them otherwise.
+#define INSN_TESTS(X)                                                        \
+  X(movntdqa_xmm, "sse4.1", "movntdqa (%0), %%xmm0", "xmm0")                 \
+  X(vmovdqu_ymm, "avx", "vmovdqu (%0), %%ymm0", "xmm0")                      \
+  X(vmaskmovps_xmm, "avx",                                                   \
+    "vpcmpeqd %%xmm1, %%xmm1, %%xmm1\n"                                      \
+    "vmaskmovps (%0), %%xmm1, %%xmm0",                                       \
+    "xmm0", "xmm1")                                                          \
+  X(vpgatherdd_ymm, "avx2",                                                  \
+    "vpxor %%xmm1, %%xmm1, %%xmm1\n"                                         \
+    "vpcmpeqd %%ymm2, %%ymm2, %%ymm2\n"                                      \
+    "vpgatherdd %%ymm2, (%0, %%ymm1, 4), %%ymm0",                            \
+    "xmm0", "xmm1", "xmm2")                                                  \
+  X(vmovdqu64_zmm, "avx512f", "vmovdqu64 (%0), %%zmm0", "xmm0")              \
+  X(vpgatherdd_zmm, "avx512f",                                               \
+    "kxnorw %%k1, %%k1, %%k1\n"                                              \
+    "vpxord %%zmm1, %%zmm1, %%zmm1\n"                                        \
+    "vpgatherdd (%0, %%zmm1, 4), %%zmm0%{%%k1%}",                            \
+    "xmm0", "xmm1")                                                          \
+  X(vpscatterdd_zmm, "avx512f",                                              \
+    "kxnorw %%k1, %%k1, %%k1\n"                                              \
+    "vpxord %%zmm1, %%zmm1, %%zmm1\n"                                        \
+    "vpscatterdd %%zmm1, (%0, %%zmm1, 4)%{%%k1%}",                           \
+    "xmm1", "memory")                                                        \
+  X(rep_movsb, "",                                                           \
+    "mov %0, %%rsi\n"                                                        \
+    "lea 2048(%0), %%rdi\n"                                                  \
+    "mov $64, %%ecx\n"                                                       \
+    "rep movsb",                                                             \
+    "rsi", "rdi", "rcx", "memory")                                           \
+  X(rep_stosq, "",                                                           \
+    "mov %0, %%rdi\n"                                                        \
+    "xor %%eax, %%eax\n"                                                     \
+    "mov $8, %%ecx\n"                                                        \
+    "rep stosq",                                                             \
+    "rdi", "rcx", "rax", "memory")                                           \
+  X(prefetcht0, "", "prefetcht0 (%0)")                                       \
+  X(prefetchnta, "", "prefetchnta (%0)")                                     \
+  X(clflush, "", "clflush (%0)", "memory")                                   \
+  X(clflushopt, "clflushopt", "clflushopt (%0)", "memory")                   \
+  X(lock_xadd, "",                                                           \
+    "mov $1, %%eax\n"                                                        \
+    "lock xaddq %%rax, (%0)",                                                \
+    "rax", "memory")                                                         \
+  X(xchg, "", "xchgq %%rax, (%0)", "rax", "memory")                          \
+  X(lock_cmpxchg16b, "cmpxchg16b",                                           \
+    "xor %%eax, %%eax\n"                                                     \
+    "xor %%edx, %%edx\n"                                                     \
+    "xor %%ebx, %%ebx\n"                                                     \
+    "xor %%ecx, %%ecx\n"                                                     \
+    "lock cmpxchg16b (%0)",                                                  \
+    "rax", "rbx", "rcx", "rdx", "memory")
+
+// Generate the test function for an instruction test.
+#define FN_INSN(name, feature, insn, ...)  \
+  void insn_##name(void *addr) {           \
+    asm volatile(insn                      \
+                 : /* no outputs */        \
+                 : "r"(addr)               \
+                 : __VA_ARGS__);           \
+  }
+
+INSN_TESTS(FN_INSN)
+
 typedef void (*test_f)(void *);
 
 enum TestType {
@@ -228,6 +326,8 @@ struct Test {
   test_f fn;
   TestType type;
   bool expect;
+  // The CPU feature the test needs (see INSN_TESTS), or nullptr.
+  const char *feature;
 };
 
 // Declare a test named "$prefix_$seg_$reg" that will call the $op_$seg_$reg()
@@ -235,7 +335,7 @@ struct Test {
 #define TEST_SEG_REG(prefix, op, seg, reg, test_type, test_expect)             \
   {                                                                            \
     .name = TEST_STR_NAME(prefix, seg, reg), .fn = TEST_FN_NAME(op, seg, reg), \
-    .type = test_type, .expect = test_expect                                   \
+    .type = test_type, .expect = test_expect, .feature = nullptr               \
   }
 
 // Test cases for a particular segment:register pair.
@@ -258,13 +358,40 @@ struct Test {
   TEST_SEG_REG(call, call, cs, reg, CS_JMP, false), TEST_REG_NOCALL(reg)
 
 // Test case for "ret_cs".
-#define TEST_RET() \
-  { .name = "ret_cs", .fn = ret_cs, .type = CS_RET, .expect = false }
+#define TEST_RET()                                                  \
+  {                                                                 \
+    .name = "ret_cs", .fn = ret_cs, .type = CS_RET, .expect = false, \
+    .feature = nullptr                                              \
+  }
+
+// Test case for an instruction test.
+#define TEST_INSN(test_name, test_feature, ...)                       \
+  {.name = #test_name, .fn = insn_##test_name, .type = NOFS_MEM_PTR, \
+   .expect = true, .feature = test_feature},
 
 // All test cases.
 Test testcases[] = {TEST_REG(rax),        TEST_REG(rbx), TEST_REG(rcx),
                     TEST_REG(rdx),        TEST_REG(rdi), TEST_REG(rsi),
-                    TEST_REG_NOCALL(rsp), TEST_REG(rbp), TEST_RET()};
+                    TEST_REG_NOCALL(rsp), TEST_REG(rbp), TEST_RET(),
+                    INSN_TESTS(TEST_INSN)};
+
+// Whether the CPU has the instructions @test needs; otherwise, it is reported
+// as skipped.
+bool cpu_supports(const Test *test) {
+  const char *f = test->feature;
+  if (!f || !*f) return true;
+  __builtin_cpu_init();
+#define CHECK_FEATURE(name) \
+  if (!strcmp(f, name)) return __builtin_cpu_supports(name);
+  CHECK_FEATURE("sse4.1")
+  CHECK_FEATURE("avx")
+  CHECK_FEATURE("avx2")
+  CHECK_FEATURE("avx512f")
+  CHECK_FEATURE("clflushopt")
+  CHECK_FEATURE("cmpxchg16b")
+#undef CHECK_FEATURE
+  return false;
+}
 
 // Child processes may change FS, which will crash inside libc functions.
 // Die immediately to avoid false failures caused by this.
@@ -274,62 +401,402 @@ void safe_exit() {
       "syscall");
 }
 
-// Run a single test case and print the result (plus the expected result, if
-// requested).
-void test_one(Test *test, bool show_expectations) {
-  int status;
-  bool test_result = false;
-  void *arg = nullptr;
+// The pointer passed to a test case.
+void *test_arg(const Test *test) {
+  switch (test->type) {
+    case CS_JMP:
+    case CS_RET:
+      return tagged_jump;
+    case FS_OFFSET:
+      return tagged_offset;
+    case FS_MEM_PTR:
+    case NOFS_MEM_PTR:
+      return tagged_addr;
+  }
+  return nullptr;
+}
+
+// Run a single test case and terminate the process: the test passes if the
+// process exits, and fails if it dies from a signal.
+[[noreturn]] void run_test(const Test *test) {
+  void *arg = test_arg(test);
+  // For "mov" and "movaps" tests that use fs: segment prefix, set FS to 0, so
+  // that the test can address the allocated memory.
+  // Note: libc relies on FS being non-zero for TLS, so we cannot call libc
+  // functions from now on.
+  if (test->type == FS_MEM_PTR) arch_prctl(ARCH_SET_FS, 0);
+  test->fn(arg);
+  safe_exit();
+  __builtin_unreachable();
+}
+
+// Fork a subprocess running a single test case, and return its pid.
+int start_test(const Test *test) {
   int pid = fork();
   if (pid == -1) {
     std::perror("fork");
     exit(EXIT_FAILURE);
   }
-  if (pid == 0) {
-    // For "mov" and "movaps" tests that use fs: segment prefix, set FS to 0, so
-    // that the test can address the allocated memory.
-    // Note: libc relies on FS being non-zero for TLS, so we cannot call libc
-    // functions from now on.
-    if (test->type == FS_MEM_PTR) arch_prctl(ARCH_SET_FS, 0);
-    switch (test->type) {
-      case CS_JMP:
-        arg = tagged_jump;
-        break;
-      case CS_RET:
-        arg = tagged_jump;
-        break;
-      case FS_OFFSET:
-        arg = tagged_offset;
-        break;
-      case FS_MEM_PTR:
-      case NOFS_MEM_PTR:
-        arg = tagged_addr;
-        break;
+  if (pid == 0) run_test(test);
+  return pid;
+}
+
+// The outcome of a test case. A test is SKIPped if the CPU cannot run it (see
+// cpu_supports()).
+enum Outcome { PENDING, PASS, FAIL, SKIP };
+
+const char *outcome_name(Outcome outcome) {
+  switch (outcome) {
+    case PASS:
+      return "PASS";
+    case FAIL:
+      return "FAIL";
+    case SKIP:
+      return "SKIP";
+    default:
+      return "PENDING";
+  }
+}
+
+// The outcome of a test case whose subprocess has terminated with @status.
+Outcome outcome_of(int status) {
+  if (WIFEXITED(status)) return PASS;
+  if (WIFSIGNALED(status)) return FAIL;
+  std::perror("Unexpected wait status");
+  exit(EXIT_FAILURE);
+}
+
+struct Result {
+  Outcome outcome = PENDING;
+  // From starting the test case to learning its outcome.
+  uint64_t time_us = 0;
+  // Taken from the baseline rather than run.
+  bool cached = false;
+};
+
+// The result of a test case in a baseline file (see load_baseline()).
+struct BaselineEntry {
+  Outcome outcome;
+  uint64_t code;
+  uint64_t time_us;
+};
+
+enum OutputFormat { TEXT, TSV, JSON };
+OutputFormat output_format = TEXT;
+std::map<std::string, BaselineEntry> baseline;
+
+// The outcome a test case is expected to have: the one in the baseline, if
+// there is one, or the one in its definition.
+Outcome expected_outcome(const Test *test) {
+  auto it = baseline.find(test->name);
+  if (it != baseline.end()) return it->second.outcome;
+  return test->expect ? PASS : FAIL;
+}
+
+// A fingerprint of a test case, so that its baseline result is only reused
+// while the test is unchanged. The size of the test function is not known, so
+// this covers its first 128 bytes of code, stopping at the end of the page;
+// these may include the start of the next function.
+uint64_t code_fingerprint(const Test *test) {
+  const unsigned char *code = (const unsigned char *)test->fn;
+  size_t size = std::min<size_t>(128, 0x1000 - (uintptr_t)code % 0x1000);
+  uint64_t hash = 0xcbf29ce484222325;
+  auto add = [&hash](unsigned char c) { hash = (hash ^ c) * 0x100000001b3; };
+  for (size_t i = 0; i < size; i++) add(code[i]);
+  for (const char *c = test->name; *c; c++) add(*c);
+  add(test->type);
+  add(test->expect);
+  return hash;
+}
+
+// The CPU model, from the CPUID brand string.
+std::string cpu_model() {
+  unsigned regs[12] = {};
+  for (unsigned i = 0; i < 3; i++)
+    __get_cpuid(0x80000002 + i, &regs[i * 4], &regs[i * 4 + 1],
+                &regs[i * 4 + 2], &regs[i * 4 + 3]);
+  std::string model((const char *)regs, strnlen((const char *)regs, 48));
+  model.erase(0, model.find_first_not_of(' '));
+  model.erase(model.find_last_not_of(' ') + 1);
+  return model.empty() ? "unknown" : model;
+}
+
+// Escape @s for a JSON string.
+std::string json_escape(const std::string &s) {
+  std::string out;
+  for (char c : s) {
+    if (c == '"' || c == '\\') out += '\\';
+    if ((unsigned char)c >= 0x20) out += c;
+  }
+  return out;
+}
+
+// Read a baseline: the TSV output of an earlier run (see print_header() and
+// report()). It only applies to the same CPU model and mode; otherwise it is
+// ignored, and every test case is run.
+void load_baseline(const char *path, const std::string &cpu,
+                   const std::string &mode) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    std::perror(path);
+    exit(EXIT_FAILURE);
+  }
+  std::string file_cpu, file_mode;
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = 0;
+    if (!strncmp(line, "# cpu: ", 7)) {
+      file_cpu = line + 7;
+      continue;
+    }
+    if (!strncmp(line, "# mode: ", 8)) {
+      file_mode = line + 8;
+      continue;
+    }
+    char name[256], result[16];
+    unsigned long time_us, code;
+    if (sscanf(line, "%255s\t%15s\t%*s\t%lu\t%lx", name, result, &time_us,
+               &code) != 4)
+      continue;
+    Outcome outcome = !strcmp(result, "PASS")   ? PASS
+                      : !strcmp(result, "FAIL") ? FAIL
+                      : !strcmp(result, "SKIP") ? SKIP
+                                                : PENDING;
+    if (outcome != PENDING) baseline[name] = {outcome, code, time_us};
+  }
+  fclose(f);
+  if (file_cpu != cpu || file_mode != mode) {
+    std::cerr << "Baseline " << path << " is for " << file_cpu << " ("
+              << file_mode << "), not " << cpu << " (" << mode
+              << "); running all tests.\n";
+    baseline.clear();
+  }
+}
+
+// Fill in the results known without running the tests: SKIP if the CPU cannot
+// run a test case, and the baseline result if the test is unchanged and
+// passed or was skipped. Test cases that are new, changed or failed are run
+// again.
+std::vector<Result> initial_results(const std::vector<const Test *> &tests) {
+  std::vector<Result> results(tests.size());
+  for (size_t i = 0; i < tests.size(); i++) {
+    const Test *test = tests[i];
+    auto it = baseline.find(test->name);
+    if (!cpu_supports(test)) {
+      results[i].outcome = SKIP;
+    } else if (it != baseline.end() &&
+               it->second.code == code_fingerprint(test) &&
+               it->second.outcome != FAIL) {
+      results[i].outcome = it->second.outcome;
+      results[i].time_us = it->second.time_us;
+      results[i].cached = true;
+    }
+  }
+  return results;
+}
+
+void print_header(const std::string &cpu, const std::string &mode) {
+  if (output_format == TSV)
+    std::cout << "# cpu: " << cpu << "\n# mode: " << mode
+              << "\nname\tresult\texpected\ttime_us\tcode\tsource\n";
+  else if (output_format == JSON)
+    std::cout << "{\"cpu\": \"" << json_escape(cpu) << "\", \"mode\": \""
+              << mode << "\", \"results\": [";
+}
+
+void print_footer() {
+  if (output_format == JSON) std::cout << "\n]}\n";
+}
+
+// Print the result of a test case (plus the expected result, if requested).
+void report(const Test *test, const Result &r, bool show_expectations) {
+  const char *result = outcome_name(r.outcome);
+  const char *expect = outcome_name(expected_outcome(test));
+  if (output_format == TSV) {
+    std::cout << test->name << "\t" << result << "\t" << expect << "\t"
+              << r.time_us << "\t" << std::hex << code_fingerprint(test)
+              << std::dec << "\t" << (r.cached ? "cached" : "run") << "\n";
+    return;
+  }
+  if (output_format == JSON) {
+    static bool first = true;
+    std::cout << (first ? "\n" : ",\n") << "  {\"name\": \"" << test->name
+              << "\", \"result\": \"" << result << "\", \"expected\": \""
+              << expect << "\", \"time_us\": " << r.time_us
+              << ", \"cached\": " << (r.cached ? "true" : "false") << "}";
+    first = false;
+    return;
+  }
+  if (r.outcome == SKIP) {
+    std::cout << test->name << ": SKIP (no " << test->feature << ")\n";
+    return;
+  }
+  const char *note = "";
+  if (r.cached)
+    note = " (cached)";
+  else if (show_expectations)
+    note = r.outcome == expected_outcome(test) ? " (expected)"
+                                               : " (unexpected)";
+  std::cout << test->name << ": " << result << note << "\n";
+}
+
+uint64_t now_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+// Run the test cases whose @results are PENDING with up to @jobs subprocesses
+// at a time. Whichever subprocess terminates first is replaced by the next
+// test case, but the results are printed in the order of @tests, each as soon
+// as it and all the results before it are known.
+void run_tests(const std::vector<const Test *> &tests,
+               std::vector<Result> &results, size_t jobs,
+               bool show_expectations) {
+  std::vector<uint64_t> start(tests.size());
+  // Test case index of every running subprocess.
+  std::map<int, size_t> running;
+  size_t next = 0, printed = 0;
+  while (printed < tests.size()) {
+    while (next < tests.size() && running.size() < jobs) {
+      if (results[next].outcome != PENDING) {
+        next++;
+        continue;
+      }
+      // Flush before forking, so that the output is not duplicated by a child
+      // that happens to flush it.
+      std::cout.flush();
+      start[next] = now_us();
+      running[start_test(tests[next])] = next;
+      next++;
     }
-    test->fn(arg);
-    safe_exit();
-  } else {
-    do {
-      int w = waitpid(pid, &status, 0);
-      if (w == -1) {
+    if (!running.empty()) {
+      int status;
+      int pid = waitpid(-1, &status, 0);
+      if (pid == -1) {
         std::perror("waitpid");
         exit(EXIT_FAILURE);
       }
-      if (WIFEXITED(status)) {
-        test_result = true;
-      } else if (WIFSIGNALED(status)) {
-        test_result = false;
-      } else {
-        std::perror("Unexpected wait status");
-        exit(EXIT_FAILURE);
+      auto it = running.find(pid);
+      if (it == running.end()) continue;
+      results[it->second].outcome = outcome_of(status);
+      results[it->second].time_us = now_us() - start[it->second];
+      running.erase(it);
+    }
+    for (; printed < next && results[printed].outcome != PENDING; printed++)
+      report(tests[printed], results[printed], show_expectations);
+  }
+}
+
+// State of the in-process mode (see run_tests_inproc()).
+sigjmp_buf recover_env;
+char alt_stack[1 << 16];
+const int kFaultSignals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGTRAP};
+
+// A test case has faulted: resume after its sigsetjmp(). This runs on the
+// alternate stack, because the faulting test may have loaded a tagged pointer
+// into %rsp.
+void recover(int sig) { siglongjmp(recover_env, sig); }
+
+// Run @test, returning 0 if it passed or the signal number if it faulted. Kept
+// out of line so that no state of the caller's loop is live across the
+// siglongjmp().
+__attribute__((noinline)) unsigned char recover_test(const Test *test) {
+  unsigned char result = sigsetjmp(recover_env, 1);
+  if (!result) test->fn(test_arg(test));
+  return result;
+}
+
+// Written by serve_tests() for a test case that was not run.
+constexpr unsigned char kNotRunByte = 0xff;
+
+// Run the PENDING ones of tests[first...] one after another in the current
+// process, writing a byte to @fd for each test case: 0 if it passed, the
+// signal number if it faulted, or kNotRunByte if it was not pending. Test
+// cases that cannot be recovered from are run as in run_test(), so that the
+// process terminates with their result: FS_MEM_PTR tests leave FS broken, and
+// control flow tests that pass exit the process.
+[[noreturn]] void serve_tests(const std::vector<const Test *> &tests,
+                              const std::vector<Result> &results, size_t first,
+                              int fd) {
+  stack_t ss = {};
+  ss.ss_sp = alt_stack;
+  ss.ss_size = sizeof(alt_stack);
+  struct sigaction sa = {};
+  sa.sa_handler = recover;
+  sa.sa_flags = SA_ONSTACK;
+  if (sigaltstack(&ss, nullptr)) {
+    std::perror("sigaltstack");
+    abort();
+  }
+  for (int sig : kFaultSignals) sigaction(sig, &sa, nullptr);
+
+  for (size_t i = first; i < tests.size(); i++) {
+    const Test *test = tests[i];
+    if (results[i].outcome != PENDING) {
+      if (write(fd, &kNotRunByte, 1) != 1) abort();
+      continue;
+    }
+    if (test->type == FS_MEM_PTR) {
+      sa.sa_handler = SIG_DFL;
+      for (int sig : kFaultSignals) sigaction(sig, &sa, nullptr);
+      run_test(test);
+    }
+    unsigned char result = recover_test(test);
+    if (write(fd, &result, 1) != 1) abort();
+  }
+  _exit(EXIT_SUCCESS);
+}
+
+// Run the test cases in a long-lived subprocess (see serve_tests()) rather
+// than in a subprocess each, and print the results as run_tests() does. A new
+// subprocess is only forked once the previous one has terminated; the test
+// case it was running at that point gets its wait status as the result. The
+// time of a test case is measured from the previous result.
+void run_tests_inproc(const std::vector<const Test *> &tests,
+                      std::vector<Result> &results, bool show_expectations) {
+  size_t next = 0;
+  while (next < tests.size()) {
+    int fds[2];
+    if (pipe(fds)) {
+      std::perror("pipe");
+      exit(EXIT_FAILURE);
+    }
+    std::cout.flush();
+    uint64_t start = now_us();
+    int pid = fork();
+    if (pid == -1) {
+      std::perror("fork");
+      exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      serve_tests(tests, results, next, fds[1]);
+    }
+    close(fds[1]);
+    unsigned char byte;
+    while (read(fds[0], &byte, 1) == 1) {
+      Result &r = results[next];
+      if (byte != kNotRunByte) {
+        uint64_t now = now_us();
+        r.outcome = byte ? FAIL : PASS;
+        r.time_us = now - start;
+        start = now;
       }
-      const char *result = test_result ? "PASS" : "FAIL";
-      const char *expect =
-          show_expectations
-              ? (test_result == test->expect ? " (expected)" : " (unexpected)")
-              : "";
-      std::cout << test->name << ": " << result << expect << "\n";
-    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+      report(tests[next++], r, show_expectations);
+    }
+    close(fds[0]);
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+      std::perror("waitpid");
+      exit(EXIT_FAILURE);
+    }
+    if (next < tests.size()) {
+      results[next].outcome = outcome_of(status);
+      results[next].time_us = now_us() - start;
+      report(tests[next], results[next], show_expectations);
+      next++;
+    }
   }
 }
 
@@ -367,13 +834,189 @@ void prepare_targets(bool use_tagging) {
   }
 }
 
+// Benchmark mode: each loop makes this many accesses, and the fastest of
+// kBenchRuns loops is reported.
+constexpr int kBenchIters = 1 << 20;
+constexpr int kBenchRuns = 5;
+
+// Time per access, in TSC ticks and in nanoseconds.
+struct Timing {
+  double ticks, ns;
+};
+
+uint64_t rdtsc() {
+  uint32_t lo, hi;
+  asm volatile("lfence\n"
+               "rdtsc\n"
+               : "=a"(lo), "=d"(hi));
+  return (uint64_t)hi << 32 | lo;
+}
+
+uint64_t now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+Timing time_access(test_f fn, void *arg) {
+  Timing best = {1e30, 1e30};
+  for (int run = 0; run < kBenchRuns; run++) {
+    uint64_t ns = now_ns(), ticks = rdtsc();
+    for (int i = 0; i < kBenchIters; i++) fn(arg);
+    ticks = rdtsc() - ticks;
+    ns = now_ns() - ns;
+    best.ticks = std::min(best.ticks, (double)ticks / kBenchIters);
+    best.ns = std::min(best.ns, (double)ns / kBenchIters);
+  }
+  return best;
+}
+
+// Time a data flow test case with an untagged pointer and, if @tagged, with
+// a tagged one, in a subprocess in case the tagged access faults. Returns
+// false if it does.
+bool bench_case(const Test *test, bool tagged, Timing *untagged_time,
+                Timing *tagged_time) {
+  void *arg = test_arg(test);
+  int fds[2];
+  if (pipe(fds)) {
+    std::perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+  std::cout.flush();
+  int pid = fork();
+  if (pid == -1) {
+    std::perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    Timing t[2] = {};
+    if (tagged) test->fn(arg);
+    t[0] = time_access(test->fn, tagged_pointer(arg));
+    if (tagged) t[1] = time_access(test->fn, arg);
+    _exit(write(fds[1], t, sizeof(t)) == sizeof(t) ? EXIT_SUCCESS
+                                                   : EXIT_FAILURE);
+  }
+  close(fds[1]);
+  Timing t[2];
+  bool ok = read(fds[0], t, sizeof(t)) == sizeof(t);
+  close(fds[0]);
+  int status;
+  if (waitpid(pid, &status, 0) == -1) {
+    std::perror("waitpid");
+    exit(EXIT_FAILURE);
+  }
+  *untagged_time = t[0];
+  *tagged_time = t[1];
+  return ok && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+// Measure the cost of tagging for the data flow test cases among @tests: the
+// time per access with tagging disabled, and, for every tag width the kernel
+// supports, with tagging enabled, through an untagged and a tagged pointer.
+// Widths that give the same untag mask as a previous one select the same
+// hardware mode, and are skipped. FS_MEM_PTR tests are skipped too, because
+// they run with FS cleared, where libc cannot be used.
+void run_bench(const std::vector<const Test *> &tests) {
+  prepare_targets(true);
+  std::vector<const Test *> cases;
+  for (const Test *t : tests)
+    if ((t->type == NOFS_MEM_PTR || t->type == FS_OFFSET) && cpu_supports(t))
+      cases.push_back(t);
+
+  std::cout << "Tagging disabled, " << kBenchIters
+            << " accesses per loop (TSC ticks, ns per access):\n";
+  std::cout << std::fixed << std::setprecision(2);
+  std::vector<Timing> baseline(cases.size());
+  for (size_t i = 0; i < cases.size(); i++) {
+    Timing unused;
+    bench_case(cases[i], false, &baseline[i], &unused);
+    std::cout << "  " << cases[i]->name << ": " << baseline[i].ticks << ", "
+              << baseline[i].ns << "\n";
+  }
+
+  int max_bits = 0;
+  if (arch_prctl(ARCH_GET_MAX_TAG_BITS, &max_bits, 0, 0, 0)) {
+    std::cerr << "Pointer tagging not supported, only measured untagged "
+                 "accesses.\n";
+    return;
+  }
+  // The untag masks seen so far, shared with the subprocesses that enable
+  // tagging, since it cannot be disabled again.
+  auto *masks = (uint64_t *)mmap(nullptr, 0x1000, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (masks == MAP_FAILED) {
+    std::perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  size_t num_masks = 0;
+  for (int bits = max_bits; bits > 0; bits--) {
+    std::cout.flush();
+    int pid = fork();
+    if (pid == -1) {
+      std::perror("fork");
+      exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+      try_enable_tagging(true, bits);
+      if (std::find(masks, masks + num_masks, tag_mask) != masks + num_masks) {
+        std::cout << "  Same untag mask as with more tag bits, skipped.\n";
+        std::cout.flush();
+        _exit(EXIT_SUCCESS);
+      }
+      masks[num_masks] = tag_mask;
+      std::cout << "Tagging enabled (ticks and ns per access through an "
+                   "untagged / a tagged pointer):\n";
+      for (size_t i = 0; i < cases.size(); i++) {
+        Timing untagged, tagged;
+        std::cout << "  " << cases[i]->name << ": ";
+        if (!bench_case(cases[i], true, &untagged, &tagged)) {
+          std::cout << "FAIL\n";
+          continue;
+        }
+        std::cout << untagged.ticks << " / " << tagged.ticks << ", "
+                  << untagged.ns << " / " << tagged.ns << " ("
+                  << std::showpos
+                  << 100 * (tagged.ticks / baseline[i].ticks - 1)
+                  << std::noshowpos << "% vs. tagging disabled)\n";
+      }
+      std::cout.flush();
+      _exit(EXIT_SUCCESS);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+      std::perror("waitpid");
+      exit(EXIT_FAILURE);
+    }
+    while (num_masks < 0x1000 / sizeof(uint64_t) && masks[num_masks])
+      num_masks++;
+  }
+}
+
 // Parse the command line args and run the tests.
 int main(int argc, char *argv[]) {
   bool use_tagging = true;
   bool show_expectations = false;
+  bool inproc = false;
+  bool bench = false;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *baseline_path = nullptr;
 
   std::set<std::string> args;
   for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "baseline=", 9)) {
+      baseline_path = argv[i] + 9;
+      continue;
+    }
+    if (!strncmp(argv[i], "-j", 2)) {
+      const char *n = argv[i][2] || i + 1 == argc ? argv[i] + 2 : argv[++i];
+      jobs = atol(n);
+      if (jobs < 1) {
+        std::cerr << "Invalid number of jobs: " << n << "\n";
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
     args.insert(argv[i]);
   }
 
@@ -387,12 +1030,61 @@ int main(int argc, char *argv[]) {
     args.erase("expect");
   }
 
-  if (!try_enable_tagging(false))
+  if (args.find("inproc") != args.end()) {
+    inproc = true;
+    args.erase("inproc");
+  }
+
+  if (args.find("bench") != args.end()) {
+    bench = true;
+    args.erase("bench");
+  }
+
+  for (auto [word, format] : {std::pair{"tsv", TSV}, std::pair{"json", JSON}}) {
+    if (args.find(word) != args.end()) {
+      output_format = format;
+      info = &std::cerr;
+      args.erase(word);
+    }
+  }
+
+  std::vector<const Test *> tests;
+  for (const Test &t : testcases) {
+    if (args.empty() || (args.find(t.name) != args.end())) tests.push_back(&t);
+  }
+  if (bench) {
+    run_bench(tests);
+    return 0;
+  }
+
+  bool tagging = try_enable_tagging(false);
+  if (!tagging)
     std::cerr << "Pointer tagging not supported, proceeding without it.\n";
   prepare_targets(use_tagging);
-  for (Test t : testcases) {
-    if (args.empty() || (args.find(t.name) != args.end()))
-      test_one(&t, show_expectations);
+
+  // The results depend on whether tagged pointers are passed, and whether
+  // the hardware ignores their tags.
+  std::string cpu = cpu_model();
+  std::string mode = !use_tagging ? "notag" : tagging ? "tag" : "tag-unsupported";
+  if (baseline_path) load_baseline(baseline_path, cpu, mode);
+  std::vector<Result> results = initial_results(tests);
+  print_header(cpu, mode);
+  if (inproc)
+    run_tests_inproc(tests, results, show_expectations);
+  else
+    run_tests(tests, results, std::max(jobs, 1L), show_expectations);
+  print_footer();
+
+  // With a baseline, fail if any result has changed.
+  size_t changed = 0;
+  for (size_t i = 0; i < tests.size(); i++) {
+    auto it = baseline.find(tests[i]->name);
+    if (it != baseline.end() && it->second.outcome != results[i].outcome)
+      changed++;
+  }
+  if (changed) {
+    std::cerr << changed << " results differ from the baseline.\n";
+    return EXIT_FAILURE;
   }
   return 0;
 }
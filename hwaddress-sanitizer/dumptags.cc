@@ -1,19 +1,68 @@
+// dumptags: dump the MTE tags of every tagged page of every process into a
+// file in the format described in tagdump.h.
+//
+// Usage: dumptags [-j workers] [-z] [-a] [-S] [-T ms] [filters] output
+//        dumptags [-j workers] [-S] [-T ms] [filters] -a
+//   -j  number of processes dumped at once (default: number of CPUs).
+//   -z  compress blocks into zlib frames on top of the per-block encodings.
+//   -a  analyze the tags as they are read, and print per-mapping, per-process
+//       and overall statistics (see tagstats.h). Without an output file,
+//       nothing is written.
+//   -S  snapshot: read the maps and pagemap of a process before stopping it,
+//       and stop it with PTRACE_SEIZE and PTRACE_INTERRUPT only while its tags
+//       are read. Pages that go away in between are skipped, and a page that
+//       is replaced in between is dumped under its old PFN. Without -S, a
+//       process is stopped with PTRACE_ATTACH for the whole of its dump.
+//   -T  resume a process after it has been stopped for this many
+//       milliseconds, even if it has not been fully dumped.
+//
+// Every process is reported with the time it was stopped for.
+//
+// Filters select what is dumped; each may be given more than once.
+//   -p pid,...    only these processes.
+//   -P pid,...    not these processes.
+//   -e glob       only processes whose executable path matches.
+//   -E glob       not processes whose executable path matches.
+//   -m glob       only mappings whose name matches.
+//   -M glob       not mappings whose name matches.
+//   -r start-end  only pages in this address range (hex).
+// In globs '*' and '?' are wildcards and everything else, brackets included,
+// is literal. For example, to dump just the Scudo heap of one service:
+//   dumptags -S -e '*/surfaceflinger' -m '[anon:scudo:*]' out.tags
+//
+// Build: g++ -O2 -pthread dumptags.cc -lz -o dumptags
+
 #include <assert.h>
 #include <dirent.h>
-#include <regex>
 #include <fcntl.h>
-#include <fstream>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <set>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <sys/mman.h>
 #include <sys/ptrace.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+#include "map_table.h"
+#include "tagdump.h"
+#include "tagstats.h"
 
 #define PTRACE_PEEKMTETAGS 33
 
@@ -27,167 +76,851 @@ std::string hex_to_string(T x) {
 
 typedef unsigned long uptr;
 
-struct Map {
-  uptr start, end;
-  std::string name;
-  uptr rss, pss;
-  uptr shadow_pages;
-  unsigned prot;
-  bool mt;
-  Map(uptr start, uptr end, const std::string &p, const std::string &name)
-      : start(start),
-        end(end),
-        name(name),
-        rss(0),
-        pss(0),
-        shadow_pages(0),
-        prot(0),
-        mt(false) {
-    assert(p[0] == 'r' || p[0] == '-');
-    assert(p[1] == 'w' || p[1] == '-');
-    assert(p[2] == 'x' || p[2] == '-');
-    if (p[0] == 'r')
-      prot |= PROT_READ;
-    if (p[1] == 'w')
-      prot |= PROT_WRITE;
-    if (p[2] == 'x')
-      prot |= PROT_EXEC;
-  }
-};
+// Pagemap entries are read this many at a time: 32 KiB of entries covering
+// 16 MiB of address space, in a single pread().
+constexpr size_t kPagemapWindow = 4096;
+
+// Replace the @count pagemap entries at @pfns, for the pages starting at @addr,
+// with their PFNs, or 0 for the pages that are not present. Returns false if
+// the pagemap cannot be read, i.e. the process has exited.
+bool get_pfns(int pagemapfd, uptr addr, size_t count, uint64_t *pfns) {
+  size_t pagemap_offset = (addr / 4096) * 8;
+  ssize_t size = count * 8;
+  if (pread(pagemapfd, pfns, size, pagemap_offset) != size)
+    return false;
 
-void read_maps(int pid, std::vector<Map*> &maps) {
-  std::regex name_regex(
-      "([01-9a-f]+)-([01-9a-f]+) ([a-z-]{4}) [01-9a-f]+ "
-      "[01-9a-f]{2}:[01-9a-f]{2} [01-9a-f]+\\s*(.*)?");
-  std::regex rss_regex("Rss:\\s+(\\d+) kB");
-  std::regex pss_regex("Pss:\\s+(\\d+) kB");
-  std::regex vmflags_regex("VmFlags:(.+)");
-
-  maps.clear();
-  std::string path = "/proc/" + std::to_string(pid) + "/smaps";
-  std::ifstream smaps(path);
-  std::string line;
-  Map *current = nullptr;
-  while (std::getline(smaps, line)) {
-    std::smatch match;
-    if (std::regex_match(line, match, name_regex)) {
-      assert(match.size() == 5);
-      if (current)
-        maps.push_back(current);
-      uptr start = stoul(match[1].str(), 0, 16);
-      uptr end = stoul(match[2].str(), 0, 16);
-      current = new Map(start, end, match[3], match[4]);
-    } else if (std::regex_match(line, match, rss_regex)) {
-      assert(match.size() == 2);
-      assert(current);
-      current->rss = stoul(match[1].str());
-    } else if (std::regex_match(line, match, pss_regex)) {
-      assert(match.size() == 2);
-      assert(current);
-      current->pss = stoul(match[1].str());
-    } else if (std::regex_match(line, match, vmflags_regex)) {
-      assert(match.size() == 2);
-      assert(current);
-      current->mt = match[1].str().find(" mt") != std::string::npos;
-    }
-  }
-  if (current)
-    maps.push_back(current);
+  for (size_t i = 0; i < count; ++i) {
+    if (!(pfns[i] & (1ULL << 63)))
+      pfns[i] = 0;
+    else
+      pfns[i] &= (1ULL << 55) - 1;
+  }
+  return true;
 }
 
-uint64_t get_pfn(int pagemapfd, size_t addr) {
-  size_t pagemap_offset = (addr / 4096) * 8;
-  uint64_t pagemap_entry;
-  if (pread(pagemapfd, &pagemap_entry, 8, pagemap_offset) != 8) {
-    perror("pread pagemap");
-    exit(1);
+// Set of PFNs whose tags have been dumped already. PFNs are dense and bounded
+// by the size of physical memory, so this is a bitmap with one bit per page
+// instead of a tree node per page. It has two levels and leaves are allocated
+// on first use, so holes in the physical address space cost nothing but a null
+// pointer. Insert() is an atomic test-and-set, safe to call from all workers.
+class SeenPfns {
+  // A leaf covers 2^21 PFNs (8 GiB of 4 KiB pages) with 256 KiB of bits.
+  static constexpr unsigned kLeafShift = 21;
+  static constexpr size_t kLeafWords = (1 << kLeafShift) / 64;
+  // Used if /proc/iomem does not tell: the largest physical address on arm64.
+  static constexpr unsigned kMaxPhysBits = 52;
+
+  typedef std::atomic<uint64_t> Leaf[kLeafWords];
+  std::unique_ptr<std::atomic<Leaf *>[]> leaves;
+  size_t num_leaves;
+
+  // PFNs beyond the end of physical memory as it was at startup, e.g. after
+  // memory hotplug.
+  std::mutex overflow_mu;
+  std::set<uint64_t> overflow;
+
+  // The end of the last "System RAM" range in /proc/iomem, or 0 if unknown.
+  // Without CAP_SYS_ADMIN every range reads as 00000000-00000000, and is
+  // ignored.
+  static uint64_t ReadMaxPhysAddr() {
+    FILE *f = fopen("/proc/iomem", "r");
+    if (!f)
+      return 0;
+    uint64_t max_end = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+      uint64_t start, end;
+      if (sscanf(line, "%" SCNx64 "-%" SCNx64, &start, &end) == 2 &&
+          end > start && strstr(line, " : System RAM"))
+        max_end = std::max(max_end, end + 1);
+    }
+    fclose(f);
+    return max_end;
   }
 
-  if (!(pagemap_entry & (1ULL << 63))) {
-    return 0;
+ public:
+  SeenPfns() {
+    uint64_t max_addr = ReadMaxPhysAddr();
+    if (!max_addr)
+      max_addr = 1ULL << kMaxPhysBits;
+    uint64_t max_pfn = max_addr / 4096;
+    num_leaves = (max_pfn >> kLeafShift) + 1;
+    leaves.reset(new std::atomic<Leaf *>[num_leaves]());
   }
 
-  return pagemap_entry & ((1ULL << 55) - 1);
-}
+  ~SeenPfns() {
+    for (size_t i = 0; i < num_leaves; ++i)
+      free(leaves[i].load());
+  }
+
+  // Whether @pfn has been inserted.
+  bool Contains(uint64_t pfn) {
+    size_t index = pfn >> kLeafShift;
+    if (index >= num_leaves) {
+      std::lock_guard<std::mutex> lock(overflow_mu);
+      return overflow.count(pfn);
+    }
+    Leaf *leaf = leaves[index].load(std::memory_order_acquire);
+    uint64_t bit = pfn & ((1 << kLeafShift) - 1);
+    return leaf && ((*leaf)[bit / 64].load(std::memory_order_relaxed) >>
+                    (bit % 64) & 1);
+  }
+
+  // Returns true if @pfn has not been seen before.
+  bool Insert(uint64_t pfn) {
+    size_t index = pfn >> kLeafShift;
+    if (index >= num_leaves) {
+      std::lock_guard<std::mutex> lock(overflow_mu);
+      return overflow.insert(pfn).second;
+    }
+    Leaf *leaf = leaves[index].load(std::memory_order_acquire);
+    if (!leaf) {
+      Leaf *new_leaf = (Leaf *)calloc(1, sizeof(Leaf));
+      assert(new_leaf);
+      if (leaves[index].compare_exchange_strong(leaf, new_leaf,
+                                                std::memory_order_acq_rel)) {
+        leaf = new_leaf;
+      } else {
+        // Another worker got there first; @leaf is now theirs.
+        free(new_leaf);
+      }
+    }
+    uint64_t bit = pfn & ((1 << kLeafShift) - 1);
+    uint64_t mask = 1ULL << (bit % 64);
+    return !((*leaf)[bit / 64].fetch_or(mask, std::memory_order_relaxed) &
+             mask);
+  }
+};
 
-std::set<uint64_t> seen_pfns;
+SeenPfns seen_pfns;
 int outfd;
+// Serializes the progress messages of the workers.
+std::mutex log_mu;
 
-void dump_map_tags(int pid, int pagemapfd, Map *m) {
-  assert(m->start % 4096 == 0);
-  assert(m->end % 4096 == 0);
-  std::cerr << "dumping: " << (void *)m->start << " .. " << (void *)m->end << "  " << m->name;
+constexpr uptr kTagsPerPage = kTagDumpTagsPerPage;
 
-  uint64_t total = 0, present = 0, dumped = 0;
-  for (uptr addr = m->start; addr != m->end; addr += 4096) {
-    ++total;
-    uint64_t pfn = get_pfn(pagemapfd, addr);
-    if (pfn == 0)
-      continue;
-    ++present;
-    if (!seen_pfns.insert(pfn).second)
-      continue;
-    ++dumped;
+// Consecutive pages are fetched with a single PTRACE_PEEKMTETAGS of up to this
+// many pages (16 KiB of tags).
+constexpr size_t kMaxTagRun = 64;
+
+// Encodes, optionally compresses, and writes the dump on a thread of its own,
+// so that the workers only ever wait for ptrace. Workers hand over buffers of
+// records in which every block is kTagsRaw; the writer re-encodes each block
+// with EncodeTags(), with -z packs the blocks into zlib frames, appends the
+// result to the output file and records where each block ended up in
+// @pfn_index. The queue is bounded, so a slow disk throttles the workers
+// instead of filling up memory.
+class Writer {
+  static constexpr size_t kMaxQueued = 64 << 20;
+  static constexpr size_t kFrameSize = 64 << 10;
+  static constexpr size_t kWriteSize = 4 << 20;
+
+  const bool compress;
+  std::mutex mu;
+  std::condition_variable cv;
+  std::deque<std::vector<char>> queue;
+  size_t queued = 0;
+  bool done = false;
+
+  // Owned by the writer thread: the size of the output file so far, data not
+  // written yet, and with -z the blocks of the frame being built.
+  uint64_t offset = sizeof(TagDumpHeader);
+  std::vector<char> out;
+  std::vector<char> frame;
+  std::vector<uint64_t> frame_pfns;
+
+  void WriteOut() {
+    if (write(outfd, out.data(), out.size()) != (ssize_t)out.size()) {
+      perror("write");
+      exit(1);
+    }
+    offset += out.size();
+    out.clear();
+  }
+
+  void FlushFrame() {
+    if (frame_pfns.empty())
+      return;
+    for (uint64_t pfn : frame_pfns)
+      pfn_index.push_back({pfn, offset + out.size()});
+    AppendFrame(frame.data(), frame.size(), frame_pfns.size(), &out);
+    frame.clear();
+    frame_pfns.clear();
+  }
+
+  void Process(const std::vector<char> &buf) {
+    for (size_t pos = 0; pos < buf.size();) {
+      RecordHeader h;
+      memcpy(&h, buf.data() + pos, sizeof(h));
+      const char *payload = buf.data() + pos + sizeof(h);
+      pos += sizeof(h) + h.size;
+      if (h.type != kRecordBlock) {
+        out.insert(out.end(), payload - sizeof(h), payload + h.size);
+        continue;
+      }
+
+      assert(h.encoding == kTagsRaw &&
+             h.size == sizeof(BlockRecord) + kTagsPerPage);
+      BlockRecord block;
+      memcpy(&block, payload, sizeof(block));
+      uint8_t encoded[kTagsPerPage];
+      uint32_t size;
+      h.encoding = EncodeTags((const uint8_t *)payload + sizeof(block),
+                              encoded, &size);
+      h.size = sizeof(block) + size;
+      raw_bytes += kTagsPerPage;
+
+      std::vector<char> &dst = compress ? frame : out;
+      if (compress)
+        frame_pfns.push_back(block.pfn);
+      else
+        pfn_index.push_back({block.pfn, offset + out.size()});
+      dst.insert(dst.end(), (const char *)&h, (const char *)(&h + 1));
+      dst.insert(dst.end(), payload, payload + sizeof(block));
+      dst.insert(dst.end(), (const char *)encoded, (const char *)encoded + size);
+      if (frame.size() >= kFrameSize)
+        FlushFrame();
+    }
+    if (out.size() >= kWriteSize)
+      WriteOut();
+  }
+
+  void Run() {
+    for (;;) {
+      std::vector<char> buf;
+      {
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&] { return done || !queue.empty(); });
+        if (queue.empty())
+          break;
+        buf = std::move(queue.front());
+        queue.pop_front();
+        queued -= buf.size();
+        cv.notify_all();
+      }
+      Process(buf);
+    }
+    FlushFrame();
+    WriteOut();
+  }
+
+ public:
+  // Valid after Finish().
+  std::vector<PfnEntry> pfn_index;
+  uint64_t raw_bytes = 0;
+
+  explicit Writer(bool compress)
+      : compress(compress), thread(&Writer::Run, this) {}
+
+  void Push(std::vector<char> &&buf) {
+    std::unique_lock<std::mutex> lock(mu);
+    cv.wait(lock, [&] { return queued < kMaxQueued; });
+    queued += buf.size();
+    queue.push_back(std::move(buf));
+    cv.notify_all();
+  }
+
+  // Write out everything queued and stop the thread. Returns the size of the
+  // output file.
+  uint64_t Finish() {
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      done = true;
+      cv.notify_all();
+    }
+    thread.join();
+    return offset;
+  }
+
+ private:
+  // Declared last, so that it starts once everything else is constructed.
+  std::thread thread;
+};
+
+// Null when only analyzing.
+Writer *writer;
+// Set by -a.
+bool analyze = false;
+
+// State of one worker thread, which dumps one process at a time. Records (see
+// tagdump.h) are collected in @out and handed to the writer in large pieces;
+// records carry their pid, so pieces from different workers may be
+// interleaved. Progress messages for the current process are kept in @log and
+// printed together once it is done. The worker also collects an address index
+// entry for every present page it comes across.
+struct Worker {
+  static constexpr size_t kFlushSize = 4 << 20;
+
+  std::vector<char> out;
+  std::ostringstream log;
+  uint64_t ptrace_calls = 0, dumped_pages = 0;
+  // Pages that were planned but not read: gone by the time the process was
+  // stopped, or left over when -T cut its stop short.
+  uint64_t missed_pages = 0;
+  // The longest stop, and the number of processes resumed before they were
+  // fully dumped.
+  uint64_t longest_stop_ns = 0, cut_short = 0;
+  std::vector<AddrEntry> addr_index;
+  // With -a: the mapping and process being dumped, and everything this worker
+  // has dumped.
+  TagStats map_stats, proc_stats, stats;
+
+  void Append(const void *p, size_t size) {
+    out.insert(out.end(), (const char *)p, (const char *)p + size);
+  }
+
+  template <typename Fixed>
+  void WriteRecord(RecordType type, uint8_t encoding, const Fixed &fixed,
+                   const void *trailer, size_t trailer_size) {
+    RecordHeader h = {type, encoding, 0,
+                      (uint32_t)(sizeof(Fixed) + trailer_size)};
+    Append(&h, sizeof(h));
+    Append(&fixed, sizeof(fixed));
+    Append(trailer, trailer_size);
+  }
+
+  // The writer encodes the tags. The page is claimed here, once its tags have
+  // been read, so that a page another worker planned but could not read is
+  // not lost. Pages claimed already are dropped.
+  void WriteBlock(int pid, uptr addr, uint64_t pfn, const uint8_t *tags) {
+    if (!seen_pfns.Insert(pfn))
+      return;
+    dumped_pages++;
+    if (analyze)
+      map_stats.AddPage(tags);
+    if (!writer)
+      return;
+    WriteRecord(kRecordBlock, kTagsRaw, BlockRecord{(uint32_t)pid, 0, addr, pfn},
+                tags, kTagsPerPage);
+    if (out.size() >= kFlushSize)
+      Flush();
+  }
+
+  // Without a writer, the process and mapping records are dropped here.
+  void Flush() {
+    if (writer)
+      writer->Push(std::move(out));
+    out.clear();
+  }
+};
+
+// Write the tags of the @pages pages starting at @addr, whose PFNs are @pfns,
+// to the worker's output. The kernel may copy fewer tags than asked for, e.g.
+// if it cannot access one of the pages; whatever is left is then fetched a page
+// at a time. A page that cannot be read at all is fatal, unless @skipped is
+// given, in which case it is counted there and left out of the dump. Returns
+// the number of ptrace calls made.
+uint64_t dump_tag_run(Worker *w, int pid, uptr addr, const uint64_t *pfns,
+                      size_t pages, uint64_t *skipped = nullptr) {
+  uint8_t buf[kMaxTagRun * kTagsPerPage];
+  iovec iov = {buf, pages * kTagsPerPage};
+  long res = ptrace(PTRACE_PEEKMTETAGS, pid, (void *)addr, &iov);
+  uint64_t calls = 1;
+  size_t done = res == 0 ? iov.iov_len / kTagsPerPage : 0;
+  for (size_t i = 0; i < done; ++i)
+    w->WriteBlock(pid, addr + i * 4096, pfns[i], buf + i * kTagsPerPage);
 
-    constexpr uptr size = 4096 / 16;
-    char buf[size];
-    iovec iov = {buf, size};
-    long res = ptrace(PTRACE_PEEKMTETAGS, pid, (void *)addr, &iov);
+  for (; done < pages; ++done, ++calls) {
+    iov = {buf, kTagsPerPage};
+    res = ptrace(PTRACE_PEEKMTETAGS, pid, (void *)(addr + done * 4096), &iov);
+    if (res != 0 && skipped) {
+      ++*skipped;
+      continue;
+    }
     if (res != 0) {
       perror("peekmtetags");
       exit(1);
     }
-    assert(res == 0 && iov.iov_len == size);
+    assert(res == 0 && iov.iov_len == kTagsPerPage);
+    w->WriteBlock(pid, addr + done * 4096, pfns[done], buf);
+  }
+  return calls;
+}
 
-    if (write(outfd, buf, size) != size) {
-      perror("write");
-      exit(1);
+// Whether @s matches the shell-style pattern @pat, in which '*' matches any
+// string and '?' any single character. Unlike fnmatch(), brackets have no
+// special meaning: mapping names such as [anon:scudo:primary] are full of them.
+bool glob_match(std::string_view pat, std::string_view s) {
+  size_t p = 0, i = 0;
+  // Where to resume after the last '*' if the rest fails to match.
+  size_t star = std::string_view::npos, star_i = 0;
+  while (i < s.size()) {
+    if (p < pat.size() && (pat[p] == '?' || pat[p] == s[i])) {
+      ++p;
+      ++i;
+    } else if (p < pat.size() && pat[p] == '*') {
+      star = p++;
+      star_i = i;
+    } else if (star != std::string_view::npos) {
+      p = star + 1;
+      i = ++star_i;
+    } else {
+      return false;
     }
   }
+  while (p < pat.size() && pat[p] == '*')
+    ++p;
+  return p == pat.size();
+}
+
+// What to dump, from -p, -P, -e, -E, -m, -M and -r. An include list lets
+// through only what matches one of its entries, unless it is empty; an exclude
+// list drops whatever matches one of its entries.
+struct Filter {
+  std::vector<int> pids, skip_pids;
+  // Globs of executable paths and of mapping names.
+  std::vector<std::string> exes, skip_exes, maps, skip_maps;
+  // Page-aligned [start, end) address ranges, sorted and disjoint.
+  std::vector<std::pair<uptr, uptr>> ranges;
+
+  static bool AnyGlob(const std::vector<std::string> &globs,
+                      std::string_view s) {
+    for (const std::string &g : globs)
+      if (glob_match(g, s))
+        return true;
+    return false;
+  }
+
+  static bool Include(const std::vector<std::string> &globs,
+                      const std::vector<std::string> &skip,
+                      std::string_view s) {
+    return (globs.empty() || AnyGlob(globs, s)) && !AnyGlob(skip, s);
+  }
+
+  bool WantPid(int pid) const {
+    auto has = [pid](const std::vector<int> &v) {
+      return std::find(v.begin(), v.end(), pid) != v.end();
+    };
+    return (pids.empty() || has(pids)) && !has(skip_pids);
+  }
+
+  bool WantExe(const char *exe) const { return Include(exes, skip_exes, exe); }
+
+  // The tagged mappings to dump.
+  bool WantMap(const MapTable &table, size_t i) const {
+    return (table.flags[i] & kMapMT) &&
+           Include(maps, skip_maps, table.NameView(i)) &&
+           !Clip(table.start[i], table.end[i]).empty();
+  }
+
+  // The parts of [start, end) to dump, in order.
+  std::vector<std::pair<uptr, uptr>> Clip(uptr start, uptr end) const {
+    if (ranges.empty())
+      return {{start, end}};
+    std::vector<std::pair<uptr, uptr>> parts;
+    for (auto [lo, hi] : ranges)
+      if (lo < end && hi > start)
+        parts.push_back({std::max(lo, start), std::min(hi, end)});
+    return parts;
+  }
 
-  std::cerr << ": " << total << " pages, " << present << " present" << ", " << dumped << " dumped\n";
+  // Parse "pid,pid,..." into @out.
+  static bool ParsePids(const char *arg, std::vector<int> *out) {
+    for (;;) {
+      char *end;
+      long pid = strtol(arg, &end, 10);
+      if (end == arg || pid <= 0 || (*end != ',' && *end != 0))
+        return false;
+      out->push_back(pid);
+      if (!*end)
+        return true;
+      arg = end + 1;
+    }
+  }
+
+  // Parse "start-end", in hex, widened to whole pages.
+  bool AddRange(const char *arg) {
+    char *end;
+    uptr lo = strtoull(arg, &end, 16);
+    if (end == arg || *end != '-')
+      return false;
+    const char *hi_arg = end + 1;
+    uptr hi = strtoull(hi_arg, &end, 16);
+    if (end == hi_arg || *end != 0 || hi <= lo)
+      return false;
+    ranges.push_back({lo & ~uptr(4095), (hi + 4095) & ~uptr(4095)});
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<std::pair<uptr, uptr>> merged;
+    for (auto r : ranges) {
+      if (!merged.empty() && r.first <= merged.back().second)
+        merged.back().second = std::max(merged.back().second, r.second);
+      else
+        merged.push_back(r);
+    }
+    ranges = std::move(merged);
+    return true;
+  }
+};
+
+Filter filter;
+
+// Set by -S: read the maps and pagemap of a process before stopping it, so
+// that it is only stopped while its tags are read.
+bool snapshot = false;
+// Set by -T: a process is resumed after at most this long, dumped or not.
+// Zero means no limit.
+uint64_t max_stop_ns = 0;
+
+uint64_t now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// The pages of mapping @map to dump (within the -r ranges, if any), as found
+// in the pagemap: runs of consecutive present pages whose PFNs have not been
+// dumped yet, of at most kMaxTagRun pages each. A PFN is only claimed once its
+// tags are written (see Worker::WriteBlock()), so two workers may both plan
+// it, and the one that reads it second drops its copy.
+struct MapPlan {
+  size_t map;
+  uint64_t total = 0, present = 0;
+  // Start and length in pages of each run.
+  std::vector<std::pair<uptr, uint32_t>> runs;
+  // The PFNs of the pages of all runs, in order.
+  std::vector<uint64_t> pfns;
+  // Address index entries for all present pages, added to the worker's once
+  // the mapping is dumped.
+  std::vector<AddrEntry> addrs;
+};
+
+// Returns false if the pagemap could not be read because the process exited.
+bool plan_map_tags(int pid, int pagemapfd, const MapTable &maps, size_t i,
+                   MapPlan *plan) {
+  uptr start = maps.start[i], end = maps.end[i];
+  assert(start % 4096 == 0);
+  assert(end % 4096 == 0);
+  plan->map = i;
+
+  std::vector<uint64_t> pfns(kPagemapWindow);
+  for (auto [part_start, part_end] : filter.Clip(start, end)) {
+    for (uptr window = part_start; window != part_end;) {
+      size_t count = std::min<uptr>((part_end - window) / 4096, kPagemapWindow);
+      if (!get_pfns(pagemapfd, window, count, pfns.data()))
+        return false;
+      for (size_t j = 0; j < count; ++j) {
+        uptr addr = window + j * 4096;
+        ++plan->total;
+        uint64_t pfn = pfns[j];
+        if (pfn == 0)
+          continue;
+        ++plan->present;
+        if (writer)
+          plan->addrs.push_back({(uint32_t)pid, 0, addr, pfn});
+        if (seen_pfns.Contains(pfn))
+          continue;
+
+        if (plan->runs.empty() || plan->runs.back().second == kMaxTagRun ||
+            addr != plan->runs.back().first + plan->runs.back().second * 4096)
+          plan->runs.push_back({addr, 0});
+        plan->runs.back().second++;
+        plan->pfns.push_back(pfn);
+      }
+      window += count * 4096;
+    }
+  }
+  return true;
+}
+
+// Dump the pages planned for a mapping, unless @deadline (in now_ns() time,
+// zero for none) passes first. In snapshot mode pages that have gone since the
+// pagemap was read are skipped. Returns false if the deadline passed.
+bool dump_map_tags(Worker *w, int pid, const MapTable &maps,
+                   const MapPlan &plan, uint64_t deadline) {
+  size_t i = plan.map;
+  uptr start = maps.start[i], end = maps.end[i];
+  w->log << "dumping: " << (void *)start << " .. " << (void *)end << "  " << maps.Name(i);
+  std::string_view name = maps.NameView(i);
+  w->WriteRecord(kRecordMapping, 0, MappingRecord{(uint32_t)pid, 0, start, end},
+                 name.data(), name.size());
+
+  uint64_t calls = 0, skipped = 0, dumped_before = w->dumped_pages;
+  const uint64_t *pfns = plan.pfns.data();
+  size_t r = 0;
+  for (; r < plan.runs.size(); ++r) {
+    if (deadline && now_ns() > deadline)
+      break;
+    auto [run_start, run_pages] = plan.runs[r];
+    calls += dump_tag_run(w, pid, run_start, pfns, run_pages,
+                          snapshot ? &skipped : nullptr);
+    pfns += run_pages;
+  }
+  // Pages read but not dumped here were dumped through another mapping
+  // meanwhile.
+  uint64_t dumped = w->dumped_pages - dumped_before;
+  uint64_t not_dumped = plan.pfns.size() - (pfns - plan.pfns.data()) + skipped;
+
+  w->ptrace_calls += calls;
+  w->missed_pages += not_dumped;
+  w->addr_index.insert(w->addr_index.end(), plan.addrs.begin(),
+                       plan.addrs.end());
+  w->log << ": " << plan.total << " pages, " << plan.present << " present" << ", " << dumped << " dumped, " << calls << " ptrace calls";
+  if (not_dumped)
+    w->log << ", " << not_dumped << " not dumped";
+  w->log << '\n';
+  if (analyze) {
+    w->log << "  tags: " << w->map_stats.Format() << '\n';
+    w->proc_stats.Add(w->map_stats);
+    w->map_stats = TagStats();
+  }
+  return r == plan.runs.size();
+}
+
+// Stop @pid so that its tags can be read. Returns false if it has exited.
+// In snapshot mode the tracee is seized and interrupted rather than sent
+// SIGSTOP, which it (and its parent) could observe. If a signal raced with the
+// interrupt, it is stored in @*sig for delivery on detach.
+bool stop_pid(int pid, int *sig) {
+  *sig = 0;
+  long res = snapshot ? ptrace(PTRACE_SEIZE, pid, nullptr, nullptr)
+                      : ptrace(PTRACE_ATTACH, pid, nullptr, nullptr);
+  if (res != 0 && errno == ESRCH)
+    return false;
+  if (res != 0) {
+    perror("ptrace attach");
+    exit(1);
+  }
+  if (snapshot && ptrace(PTRACE_INTERRUPT, pid, nullptr, nullptr) != 0) {
+    if (errno == ESRCH)
+      return false;
+    perror("ptrace interrupt");
+    exit(1);
+  }
+  // The tracee must be stopped before its tags can be read. After
+  // PTRACE_ATTACH, signals that were already pending are dequeued before the
+  // SIGSTOP, lowest number first; each of them is delivered as the tracee is
+  // let go to the next stop, so that none is lost and the SIGSTOP is consumed
+  // rather than left to stop the tracee after the dump.
+  for (;;) {
+    int status;
+    if (waitpid(pid, &status, __WALL) != pid) {
+      perror("waitpid");
+      exit(1);
+    }
+    if (!WIFSTOPPED(status))
+      return false;
+    if (snapshot) {
+      if (status >> 16 != PTRACE_EVENT_STOP)
+        *sig = WSTOPSIG(status);
+      return true;
+    }
+    if (WSTOPSIG(status) == SIGSTOP)
+      return true;
+    if (ptrace(PTRACE_CONT, pid, nullptr, (void *)(long)WSTOPSIG(status)) != 0) {
+      if (errno == ESRCH)
+        return false;
+      perror("ptrace cont");
+      exit(1);
+    }
+  }
 }
 
-void dump_pid_tags(int pid) {
+void dump_pid_tags(Worker *w, int pid, const char *exe) {
   int pagemapfd = open(("/proc/" + std::to_string(pid) + "/pagemap").c_str(), O_RDONLY);
+  if (pagemapfd < 0 && errno == ENOENT) {
+    w->log << "pid " << pid << " exited before it could be stopped\n";
+    return;
+  }
   if (pagemapfd < 0) {
     perror("open pagemap");
     exit(1);
   }
 
-  int res = ptrace(PTRACE_ATTACH, pid, nullptr, nullptr);
-  if (res != 0) {
-    perror("ptrace attach");
-    exit(1);
+  // In snapshot mode the process keeps running while it is planned, and may
+  // exit at any point.
+  MapTable maps;
+  std::vector<MapPlan> plans;
+  if (snapshot) {
+    maps.Read(pid);
+    for (size_t i = 0; i < maps.size(); ++i) {
+      if (!filter.WantMap(maps, i))
+        continue;
+      plans.emplace_back();
+      if (!plan_map_tags(pid, pagemapfd, maps, i, &plans.back())) {
+        w->log << "pid " << pid << " exited before it could be stopped\n";
+        close(pagemapfd);
+        return;
+      }
+    }
   }
 
-  std::vector<Map*> maps;
-  read_maps(pid, maps);
+  // In snapshot mode, a process with no pages left to read need not be stopped
+  // at all, e.g. when the filters leave none of its mappings.
+  bool stop = !snapshot || std::any_of(plans.begin(), plans.end(),
+                                       [](const MapPlan &plan) {
+                                         return !plan.runs.empty();
+                                       });
+  int sig = 0;
+  if (stop && !stop_pid(pid, &sig)) {
+    w->log << "pid " << pid << " exited before it could be stopped\n";
+    close(pagemapfd);
+    return;
+  }
+  uint64_t stopped = now_ns();
+  uint64_t deadline = max_stop_ns ? stopped + max_stop_ns : 0;
 
-  for (auto m : maps) {
-    if (!m->mt)
-      continue;
-    dump_map_tags(pid, pagemapfd, m);
+  w->WriteRecord(kRecordProcess, 0, ProcessRecord{(uint32_t)pid, 0}, exe,
+                 strlen(exe));
+  bool complete = true, exited = false;
+  // Mappings left unplanned once the deadline has passed.
+  size_t maps_left = 0;
+  if (snapshot) {
+    for (const MapPlan &plan : plans)
+      complete &= dump_map_tags(w, pid, maps, plan, complete ? deadline : 1);
+  } else {
+    // The process is stopped while it is planned, so once the deadline has
+    // passed the remaining mappings are not even looked at. It can still be
+    // killed.
+    maps.Read(pid);
+    for (size_t i = 0; i < maps.size() && !exited; ++i) {
+      if (!filter.WantMap(maps, i))
+        continue;
+      if (!complete) {
+        maps_left++;
+        continue;
+      }
+      MapPlan plan;
+      if (!plan_map_tags(pid, pagemapfd, maps, i, &plan))
+        exited = true;
+      else
+        complete &= dump_map_tags(w, pid, maps, plan, deadline);
+    }
   }
 
-  res = ptrace(PTRACE_DETACH, pid, nullptr, nullptr);
-  if (res != 0) {
-    perror("ptrace attach");
-    exit(1);
+  if (!stop) {
+    w->log << "pid " << pid << " not stopped: nothing to read\n";
+  } else {
+    long res = ptrace(PTRACE_DETACH, pid, nullptr, (void *)(long)sig);
+    if (res != 0 && errno == ESRCH) {
+      exited = true;
+    } else if (res != 0) {
+      perror("ptrace detach");
+      exit(1);
+    }
+    uint64_t stop_ns = now_ns() - stopped;
+    w->longest_stop_ns = std::max(w->longest_stop_ns, stop_ns);
+    w->log << "pid " << pid << " stopped for " << stop_ns / 1e6 << " ms";
+    if (exited) {
+      w->log << ", exited while it was being dumped";
+    } else if (!complete) {
+      w->log << ", resumed before it was fully dumped";
+      if (maps_left)
+        w->log << " (" << maps_left << " mappings not read)";
+      w->cut_short++;
+    }
+    w->log << '\n';
+  }
+  if (analyze) {
+    w->log << "pid " << pid << " tags: " << w->proc_stats.Format() << '\n';
+    w->stats.Add(w->proc_stats);
+    w->proc_stats = TagStats();
   }
 
   close(pagemapfd);
 }
 
+// Append the index after the records, which end at @records_end, and point
+// the header at it.
+void write_index(TagDumpHeader *header, uint64_t records_end,
+                 const std::vector<PfnEntry> &pfns,
+                 const std::vector<AddrEntry> &addrs) {
+  header->records_end = records_end;
+  header->index_offset = (records_end + 7) & ~7ULL;
+  TagDumpIndex index = {pfns.size(), addrs.size()};
+  static const char kPadding[8] = {};
+  std::pair<const void *, size_t> parts[] = {
+      {kPadding, header->index_offset - header->records_end},
+      {&index, sizeof(index)},
+      {pfns.data(), pfns.size() * sizeof(PfnEntry)},
+      {addrs.data(), addrs.size() * sizeof(AddrEntry)},
+  };
+  for (auto &part : parts) {
+    if (write(outfd, part.first, part.second) != (ssize_t)part.second) {
+      perror("write");
+      exit(1);
+    }
+  }
+  if (pwrite(outfd, header, sizeof(*header), 0) != sizeof(*header)) {
+    perror("pwrite");
+    exit(1);
+  }
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
+  unsigned num_workers = std::max(1u, std::thread::hardware_concurrency());
+  bool compress = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:zaST:p:P:e:E:m:M:r:")) != -1) {
+    switch (opt) {
+      case 'j':
+        num_workers = std::max(1, atoi(optarg));
+        break;
+      case 'z':
+        compress = true;
+        break;
+      case 'a':
+        analyze = true;
+        break;
+      case 'S':
+        snapshot = true;
+        break;
+      case 'T':
+        max_stop_ns = strtoull(optarg, nullptr, 10) * 1000000;
+        break;
+      case 'p':
+      case 'P':
+        if (!Filter::ParsePids(optarg, opt == 'p' ? &filter.pids
+                                                  : &filter.skip_pids)) {
+          std::cerr << "bad pid list: " << optarg << '\n';
+          return 1;
+        }
+        break;
+      case 'e':
+        filter.exes.push_back(optarg);
+        break;
+      case 'E':
+        filter.skip_exes.push_back(optarg);
+        break;
+      case 'm':
+        filter.maps.push_back(optarg);
+        break;
+      case 'M':
+        filter.skip_maps.push_back(optarg);
+        break;
+      case 'r':
+        if (!filter.AddRange(optarg)) {
+          std::cerr << "bad address range: " << optarg << '\n';
+          return 1;
+        }
+        break;
+      default:
+        std::cerr << "usage: " << argv[0]
+                  << " [-j workers] [-z] [-a] [-S] [-T ms] [-p pids] [-P pids]"
+                     " [-e glob] [-E glob] [-m glob] [-M glob] [-r start-end]"
+                     " output\n";
+        return 1;
+    }
+  }
+  if (optind + 1 != argc && !(analyze && optind == argc)) {
     std::cerr << "arg required\n";
     return 1;
   }
-  outfd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-  if (outfd < 0) {
-    perror("open");
-    exit(1);
+  // The offsets are filled in once the dump is complete.
+  TagDumpHeader header = {};
+  if (optind < argc) {
+    outfd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outfd < 0) {
+      perror("open");
+      exit(1);
+    }
+    memcpy(header.magic, kTagDumpMagic, sizeof(header.magic));
+    header.version = kTagDumpVersion;
+    header.page_size = kTagDumpPageSize;
+    if (write(outfd, &header, sizeof(header)) != sizeof(header)) {
+      perror("write");
+      exit(1);
+    }
+    writer = new Writer(compress);
   }
 
   DIR *proc = opendir("/proc");
@@ -196,36 +929,101 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
+  std::vector<int> pids;
   while (dirent *ent = readdir(proc)) {
     char *end;
     int pid = strtol(ent->d_name, &end, 10);
     if (*end != 0) {
       continue;
     }
-    if (pid == getpid()) {
+    if (pid == getpid() || !filter.WantPid(pid)) {
       continue;
     }
-    
-    char exe[256];
-    size_t exe_size = readlink(
-        ("/proc/" + std::to_string(pid) + "/exe").c_str(), exe, sizeof(exe));
-    if (exe_size == -1) {
-      // Skip kernel threads.
-      if (errno == ENOENT) {
-        continue;
+    pids.push_back(pid);
+  }
+
+  closedir(proc);
+
+  // Each worker attaches to the processes it dumps itself: a tracee can only
+  // be controlled by the thread that attached to it.
+  std::vector<Worker> workers(std::min<size_t>(num_workers, pids.size()));
+  std::atomic<size_t> next_pid(0);
+  auto work = [&](Worker *w) {
+    for (size_t i; (i = next_pid++) < pids.size();) {
+      int pid = pids[i];
+      char exe[256];
+      ssize_t exe_size = readlink(
+          ("/proc/" + std::to_string(pid) + "/exe").c_str(), exe, sizeof(exe));
+      if (exe_size == -1) {
+        // Skip kernel threads.
+        if (errno == ENOENT) {
+          continue;
+        }
+        perror("readlink");
+        exit(1);
       }
-      perror("readlink");
-      exit(1);
-    }
 
-    if (exe_size >= sizeof(exe)) {
-      exe_size = sizeof(exe) - 1;
+      if (exe_size >= (ssize_t)sizeof(exe)) {
+        exe_size = sizeof(exe) - 1;
+      }
+      exe[exe_size] = 0;
+      if (!filter.WantExe(exe))
+        continue;
+
+      w->log << "dumping pid " << pid << ": " << exe << '\n';
+      dump_pid_tags(w, pid, exe);
+      w->Flush();
+      std::lock_guard<std::mutex> lock(log_mu);
+      std::cerr << w->log.str();
+      w->log.str("");
     }
-    exe[exe_size] = 0;
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < workers.size(); ++i)
+    threads.emplace_back(work, &workers[i]);
+  if (!workers.empty())
+    work(&workers[0]);
+  for (auto &t : threads)
+    t.join();
 
-    std::cerr << "dumping pid " << pid << ": " << exe << '\n';
-    dump_pid_tags(pid);
+  uint64_t ptrace_calls = 0, dumped_pages = 0, missed_pages = 0;
+  uint64_t longest_stop_ns = 0, cut_short = 0;
+  TagStats stats;
+  std::vector<AddrEntry> addr_index;
+  for (auto &w : workers) {
+    ptrace_calls += w.ptrace_calls;
+    dumped_pages += w.dumped_pages;
+    missed_pages += w.missed_pages;
+    longest_stop_ns = std::max(longest_stop_ns, w.longest_stop_ns);
+    cut_short += w.cut_short;
+    stats.Add(w.stats);
+    addr_index.insert(addr_index.end(), w.addr_index.begin(),
+                      w.addr_index.end());
+  }
+  uint64_t records_end = 0;
+  if (writer) {
+    records_end = writer->Finish();
+    std::vector<PfnEntry> &pfn_index = writer->pfn_index;
+    std::sort(pfn_index.begin(), pfn_index.end());
+    std::sort(addr_index.begin(), addr_index.end());
+    write_index(&header, records_end, pfn_index, addr_index);
   }
 
-  closedir(proc);
+  double dumped_mb = dumped_pages * 4096.0 / (1 << 20);
+  std::cerr << "dumped " << dumped_mb << " MiB with " << ptrace_calls
+            << " ptrace calls";
+  if (dumped_pages)
+    std::cerr << " (" << ptrace_calls / dumped_mb << " per MiB)";
+  if (writer)
+    std::cerr << ", " << writer->raw_bytes << " bytes of tags written as "
+              << records_end - sizeof(header);
+  std::cerr << '\n';
+  std::cerr << "longest stop " << longest_stop_ns / 1e6 << " ms";
+  if (cut_short)
+    std::cerr << ", " << cut_short << " processes resumed early";
+  if (missed_pages)
+    std::cerr << ", " << missed_pages << " pages not dumped";
+  std::cerr << '\n';
+  if (analyze)
+    std::cerr << "all tags: " << stats.Format() << '\n';
 }
@@ -0,0 +1,159 @@
+// map_table.h: compact columnar table of the mappings of a process.
+//
+// Mapping i is described by start[i], end[i], prot[i], flags[i], ... rather
+// than by a heap object per mapping, so walking the table touches a few dense
+// arrays instead of chasing a pointer per mapping. Names are interned in a
+// StringPool backed by an arena: the hundreds of thousands of mappings of a
+// JIT-heavy process share a small number of distinct names, and their bytes
+// live in a few large blocks.
+//
+//   MapTable maps;
+//   maps.Read(pid);
+//   for (size_t i = 0; i < maps.size(); ++i)
+//     printf("%lx-%lx %s\n", maps.start[i], maps.end[i], maps.Name(i));
+
+#ifndef HWADDRESS_SANITIZER_MAP_TABLE_H
+#define HWADDRESS_SANITIZER_MAP_TABLE_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "smaps.h"
+
+// Bump allocator handing out memory from large blocks, which are all freed
+// together.
+class Arena {
+  static constexpr size_t kBlockSize = 1 << 16;
+
+  std::vector<char *> blocks;
+  char *cur = nullptr;
+  size_t left = 0;
+
+ public:
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+  ~Arena() { Reset(); }
+
+  void *Alloc(size_t size, size_t align = 8) {
+    size_t pad = -(uintptr_t)cur & (align - 1);
+    if (size + pad > left) {
+      size_t block_size = std::max(kBlockSize, size + align);
+      cur = (char *)malloc(block_size);
+      assert(cur);
+      blocks.push_back(cur);
+      left = block_size;
+      pad = -(uintptr_t)cur & (align - 1);
+    }
+    void *p = cur + pad;
+    cur += size + pad;
+    left -= size + pad;
+    return p;
+  }
+
+  void Reset() {
+    for (char *b : blocks)
+      free(b);
+    blocks.clear();
+    cur = nullptr;
+    left = 0;
+  }
+};
+
+// Interned, NUL-terminated strings identified by dense 32-bit ids.
+class StringPool {
+  Arena arena;
+  std::vector<std::string_view> strings;
+  std::unordered_map<std::string_view, uint32_t> ids;
+
+ public:
+  uint32_t Intern(const char *s, size_t len) {
+    auto it = ids.find(std::string_view(s, len));
+    if (it != ids.end())
+      return it->second;
+    char *p = (char *)arena.Alloc(len + 1, 1);
+    memcpy(p, s, len);
+    p[len] = 0;
+    uint32_t id = strings.size();
+    strings.emplace_back(p, len);
+    ids.emplace(strings.back(), id);
+    return id;
+  }
+
+  const char *Get(uint32_t id) const { return strings[id].data(); }
+  std::string_view View(uint32_t id) const { return strings[id]; }
+  size_t size() const { return strings.size(); }
+
+  void Clear() {
+    ids.clear();
+    strings.clear();
+    arena.Reset();
+  }
+};
+
+// Bits in MapTable::flags.
+enum : uint8_t {
+  kMapMT = 1 << 0,  // VmFlags has "mt": MTE is enabled for the mapping.
+};
+
+struct MapTable {
+  // Sorted by address and non-overlapping, as in /proc/<pid>/smaps.
+  std::vector<unsigned long> start, end;
+  // In kB; zero when read from /proc/<pid>/maps.
+  std::vector<unsigned long> rss, pss;
+  std::vector<uint32_t> name;
+  std::vector<uint8_t> prot;
+  std::vector<uint8_t> flags;
+  StringPool names;
+
+  size_t size() const { return start.size(); }
+
+  const char *Name(size_t i) const { return names.Get(name[i]); }
+  std::string_view NameView(size_t i) const { return names.View(name[i]); }
+  bool NameIs(size_t i, const char *s) const { return NameView(i) == s; }
+
+  void Add(const SmapsEntry &e) {
+    start.push_back(e.start);
+    end.push_back(e.end);
+    rss.push_back(e.rss);
+    pss.push_back(e.pss);
+    name.push_back(names.Intern(e.name, e.name_len));
+    prot.push_back(e.prot);
+    flags.push_back(e.mt() ? kMapMT : 0);
+  }
+
+  void Clear() {
+    start.clear();
+    end.clear();
+    rss.clear();
+    pss.clear();
+    name.clear();
+    prot.clear();
+    flags.clear();
+    names.Clear();
+  }
+
+  // Replace the contents with /proc/<pid>/<file>. Leaves the table empty if
+  // the file cannot be read.
+  void Read(int pid, const char *file = "smaps") {
+    Clear();
+    SmapsReader reader(pid, file);
+    SmapsEntry e;
+    while (reader.Next(&e))
+      Add(e);
+  }
+
+  // Index of the first mapping that ends above @addr (size() if none).
+  size_t LowerBound(unsigned long addr) const {
+    return std::upper_bound(end.begin(), end.end(), addr) - end.begin();
+  }
+};
+
+#endif  // HWADDRESS_SANITIZER_MAP_TABLE_H
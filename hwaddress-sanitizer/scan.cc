@@ -1,169 +1,396 @@
+// scan: attribute the resident HWASAN shadow of a process to the user mappings
+// it describes.
+//
+// Usage: scan [-t] [-j threads] [-o format] [-s scale] [-d | -k] pid
+//        scan [-t] [-j threads] [-o format] [-s scale] [-d | -k] -a [-P procs]
+//        scan [-j threads] [-o format] [-s scale] -i seconds [-n count] pid...
+//   -t  report time spent, syscalls issued and bytes read by the shadow scan.
+//   -j  number of threads reading pagemap, per process (default: number of
+//       CPUs, divided by -P with -a).
+//   -a  scan every HWASAN process on the host and print per-process and
+//       per-mapping-name totals.
+//   -P  with -a, number of processes scanned at once (default: number of
+//       CPUs).
+//   -o  output format: text (default), json (JSON Lines), csv, or bin
+//       (protocol buffer wire format, see BinaryOutput).
+//   -i  sample the given pids every this many seconds and report how their
+//       shadow changed since the previous sample; see sample().
+//   -n  with -i, stop after this many samples (default: run until all the
+//       processes exit).
+//   -s  shadow scale: one shadow byte covers 2^scale bytes (default: 4).
+//   -d  report how many resident shadow pages are shared, i.e. the same
+//       physical page mapped by several processes (e.g. zygote children) or
+//       several times; with -a this is across all the scanned processes.
+//   -k  like -d, and also hash the content of the distinct shadow pages to
+//       estimate how much KSM could save by merging identical ones. Reads
+//       /proc/<pid>/mem, so it is much slower.
+//
+// Page sizes other than 4 KiB are supported, and transparent huge pages in the
+// shadow are recognized from kpageflags: a THP costs one kpageflags lookup
+// rather than one per base page.
+//
+// Build: g++ -O2 -pthread scan.cc -o scan
+
 #include <assert.h>
-#include <regex>
-#include <fstream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <string>
-#include <set>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <tuple>
+#include <vector>
 #include <sys/mman.h>
 
+#include "map_table.h"
+#include "smaps.h"
+
 typedef unsigned long uptr;
 
-struct Map {
-  uptr start, end;
-  std::string name;
-  uptr rss, pss;
-  uptr shadow_pages;
-  unsigned prot;
-  Map(uptr start, uptr end, const std::string &p, const std::string &name)
-      : start(start),
-        end(end),
-        name(name),
-        rss(0),
-        pss(0),
-        shadow_pages(0),
-        prot(0) {
-    assert(p[0] == 'r' || p[0] == '-');
-    assert(p[1] == 'w' || p[1] == '-');
-    assert(p[2] == 'x' || p[2] == '-');
-    if (p[0] == 'r')
-      prot |= PROT_READ;
-    if (p[1] == 'w')
-      prot |= PROT_WRITE;
-    if (p[2] == 'x')
-      prot |= PROT_EXEC;
-  }
-};
+// Reads /proc/kpageflags in bulk. Callers hand the PFNs they are about to query
+// to Prefetch(), which sorts them, coalesces them into runs and fetches each run
+// with a single pread(). Lookups are binary searches over the flat, sorted
+// array of everything loaded so far.
+//
+// PFNs are global, so in -a mode a single reader is shared by all the
+// processes being scanned. The reads themselves are done without holding the
+// lock; only merging the results into the arrays is exclusive.
+class PageFlagsReader {
+  // Read through holes of up to this many PFNs rather than issuing another
+  // pread(), and cap a single pread() at kMaxRun PFNs.
+  static constexpr uptr kMaxGap = 16;
+  static constexpr uptr kMaxRun = 8192;
 
+  std::shared_mutex mu;
+  std::vector<uptr> pfns;
+  std::vector<uptr> flags;
+  int fd;
+  std::atomic<uptr> syscalls{0}, bytes{0};
 
-class PageFlagsReader {
-  std::map<uptr, uptr> flags;
-  FILE *fp;
+  void Read(uptr first_pfn, uptr count, uptr *buf) {
+    ssize_t res = pread(fd, buf, count * 8, first_pfn * 8);
+    assert(res == (ssize_t)(count * 8));
+    syscalls++;
+    bytes += res;
+  }
 
-  void LoadFlags(uptr pfn) {
-    int res = fseek(fp, pfn * 8, SEEK_SET);
-    assert(!res);
-    uptr x;
-    res = fread(&x, 8, 1, fp);
-    assert(res == 1);
-    flags[pfn] = x;
+  bool Loaded(uptr pfn) {
+    return std::binary_search(pfns.begin(), pfns.end(), pfn);
   }
 
-  uptr GetFlags(uptr pfn) {
-    auto it = flags.find(pfn);
-    if (it == flags.end()) {
-      LoadFlags(pfn);
-      it = flags.find(pfn);
+  // Merge sorted (new_pfns, new_flags) into the arrays. Requires mu.
+  void Merge(const std::vector<uptr> &new_pfns,
+             const std::vector<uptr> &new_flags) {
+    std::vector<uptr> merged_pfns, merged_flags;
+    merged_pfns.reserve(pfns.size() + new_pfns.size());
+    merged_flags.reserve(pfns.size() + new_pfns.size());
+    size_t a = 0, b = 0;
+    while (a < pfns.size() || b < new_pfns.size()) {
+      if (b == new_pfns.size() || (a < pfns.size() && pfns[a] < new_pfns[b])) {
+        merged_pfns.push_back(pfns[a]);
+        merged_flags.push_back(flags[a++]);
+      } else {
+        // Another thread may have loaded the same PFN in the meantime.
+        if (a < pfns.size() && pfns[a] == new_pfns[b])
+          a++;
+        merged_pfns.push_back(new_pfns[b]);
+        merged_flags.push_back(new_flags[b++]);
+      }
     }
-    return it->second;
+    pfns.swap(merged_pfns);
+    flags.swap(merged_flags);
   }
 
+  std::atomic<uptr> lookups{0};
+
  public:
+  struct Stats {
+    uptr syscalls, bytes, lookups;
+  };
+
+  // Like GetFlags(), but only if the flags are loaded already.
+  bool TryGetFlags(uptr pfn, uptr *x) {
+    std::shared_lock<std::shared_mutex> lock(mu);
+    auto it = std::lower_bound(pfns.begin(), pfns.end(), pfn);
+    if (it == pfns.end() || *it != pfn)
+      return false;
+    *x = flags[it - pfns.begin()];
+    return true;
+  }
+
+  uptr GetFlags(uptr pfn) {
+    lookups.fetch_add(1, std::memory_order_relaxed);
+    uptr x;
+    if (TryGetFlags(pfn, &x))
+      return x;
+    // Not prefetched; fall back to a single read.
+    Read(pfn, 1, &x);
+    std::unique_lock<std::shared_mutex> lock(mu);
+    Merge({pfn}, {x});
+    return x;
+  }
+
   PageFlagsReader() {
-    fp = fopen("/proc/kpageflags", "rb");
-    assert(fp);
+    fd = open("/proc/kpageflags", O_RDONLY | O_CLOEXEC);
+    assert(fd >= 0);
   }
 
-  bool IsZeroPage(uptr pfn) {
-    uptr x = GetFlags(pfn);
-    bool zero = (x >> 24) & 1;
-    return zero;
+  // Load the flags for all of @want (in any order, duplicates allowed) that
+  // are not loaded yet.
+  void Prefetch(std::vector<uptr> &&want) {
+    std::sort(want.begin(), want.end());
+    want.erase(std::unique(want.begin(), want.end()), want.end());
+    {
+      std::shared_lock<std::shared_mutex> lock(mu);
+      want.erase(std::remove_if(want.begin(), want.end(),
+                                [this](uptr pfn) { return Loaded(pfn); }),
+                 want.end());
+    }
+    if (want.empty())
+      return;
+
+    std::vector<uptr> new_flags;
+    new_flags.reserve(want.size());
+    std::vector<uptr> buf(kMaxRun);
+    for (size_t i = 0; i < want.size();) {
+      uptr first = want[i];
+      size_t j = i + 1;
+      while (j < want.size() && want[j] - want[j - 1] <= kMaxGap &&
+             want[j] - first < kMaxRun)
+        ++j;
+      uptr count = want[j - 1] - first + 1;
+      Read(first, count, buf.data());
+      for (; i < j; ++i)
+        new_flags.push_back(buf[want[i] - first]);
+    }
+
+    std::unique_lock<std::shared_mutex> lock(mu);
+    Merge(want, new_flags);
+  }
+
+  Stats GetStats() const {
+    return {syscalls.load(), bytes.load(), lookups.load()};
   }
 };
 
 PageFlagsReader *PFR;
 
-void read_maps(int pid, std::vector<Map*> &maps) {
-  std::regex name_regex(
-      "([01-9a-f]+)-([01-9a-f]+) ([a-z-]{4}) [01-9a-f]+ "
-      "[01-9a-f]{2}:[01-9a-f]{2} [01-9a-f]+\\s*(.*)?");
-  std::regex rss_regex("Rss:\\s+(\\d+) kB");
-  std::regex pss_regex("Pss:\\s+(\\d+) kB");
-
-  maps.clear();
-  std::string path = "/proc/" + std::to_string(pid) + "/smaps";
-  std::ifstream smaps(path);
-  std::string line;
-  Map *current = nullptr;
-  while (std::getline(smaps, line)) {
-    std::smatch match;
-    if (std::regex_match(line, match, name_regex)) {
-      assert(match.size() == 5);
-      if (current)
-        maps.push_back(current);
-      uptr start = stoul(match[1].str(), 0, 16);
-      uptr end = stoul(match[2].str(), 0, 16);
-      current = new Map(start, end, match[3], match[4]);
-    } else if (std::regex_match(line, match, rss_regex)) {
-      assert(match.size() == 2);
-      assert(current);
-      current->rss = stoul(match[1].str());
-    } else if (std::regex_match(line, match, pss_regex)) {
-      assert(match.size() == 2);
-      assert(current);
-      current->pss = stoul(match[1].str());
+// Bits in /proc/kpageflags, from include/uapi/linux/kernel-page-flags.h.
+constexpr int kKpfCompoundHead = 15;
+constexpr int kKpfCompoundTail = 16;
+constexpr int kKpfThp = 22;
+constexpr int kKpfZeroPage = 24;
+
+// Base page size of the kernel, and the HWASAN shadow scale (-s). A shadow page
+// describes 2^shadow_scale user pages.
+uptr page_size = 4096;
+unsigned shadow_scale = 4;
+
+uptr pages_to_kb(uptr pages) {
+  return pages * page_size / 1024;
+}
+
+// [start, end) of a shadow mapping.
+typedef std::pair<uptr, uptr> Range;
+
+// Number of threads reading pagemap, set with -j.
+unsigned num_threads = 1;
+
+// Pagemap I/O counters, for -t.
+std::atomic<uptr> pagemap_reads, pagemap_bytes;
+
+// A slice of a shadow mapping scanned by one worker, together with the present
+// pages found in it. In -i mode chunks are kept between samples, and only the
+// ones whose pagemap entries changed are processed again.
+struct ScanChunk {
+  uptr start, end;
+  std::vector<uptr> addrs, pfns;
+  // Present pages that are not the zero page, and their PFNs.
+  std::vector<uptr> resident, resident_pfns;
+  // Set by scan_chunk() if the present pages differ from the previous scan,
+  // in which case the previous value of @resident is in @prev_resident.
+  bool changed = false;
+  std::vector<uptr> prev_resident;
+
+  // Whether page i directly follows page i - 1, both virtually and physically.
+  bool Continues(size_t i) const {
+    return i > 0 && addrs[i] == addrs[i - 1] + page_size &&
+           pfns[i] == pfns[i - 1] + 1;
+  }
+};
+
+// 64 MiB of shadow is 128 KiB of pagemap entries.
+std::vector<ScanChunk> make_chunks(const std::vector<Range> &shadows) {
+  constexpr uptr kChunkSize = 64 << 20;
+  std::vector<ScanChunk> chunks;
+  for (const Range &r : shadows) {
+    for (uptr start = r.first; start < r.second; start += kChunkSize) {
+      chunks.emplace_back();
+      chunks.back().start = start;
+      chunks.back().end = std::min(start + kChunkSize, r.second);
     }
   }
-  if (current)
-    maps.push_back(current);
+  return chunks;
 }
 
-void scan(FILE *fp, uptr addr, uptr start_ofs, uptr end_ofs, std::vector<uptr> &resident_pages) {
-  uptr num_resident = 0;
-  int res = fseek(fp, start_ofs, SEEK_SET);
-  assert(!res);
+// Read the pagemap entries for [chunk->start, chunk->end) and record the
+// present pages. Returns false if pagemap could not be read, e.g. because the
+// process exited.
+bool scan_chunk(int fd, ScanChunk *chunk) {
   constexpr uptr kPfnMask = (((uptr)1) << 54) - 1;
-  std::set<uptr> pfns;
-
-  uptr ofs = start_ofs;
-  constexpr uptr kBufSize = 1024;
-  uptr buf[1024];
-  uptr buf_idx = 0;
-  uptr buf_size = 0;
-  while (ofs < end_ofs) {
-    if (buf_idx >= buf_size) {
-      buf_size = fread(buf, sizeof(uptr), std::min((end_ofs - ofs) / 8, kBufSize), fp);
-      assert(buf_size >= 0);
-      buf_idx = 0;
+  constexpr uptr kBufSize = 4096;
+  uptr buf[kBufSize];
+  std::vector<uptr> addrs, pfns;
+  addrs.reserve(chunk->addrs.size());
+  pfns.reserve(chunk->pfns.size());
+  uptr addr = chunk->start;
+  while (addr < chunk->end) {
+    uptr n = std::min((chunk->end - addr) / page_size, kBufSize);
+    ssize_t res = pread(fd, buf, n * 8, addr / page_size * 8);
+    if (res != (ssize_t)(n * 8))
+      return false;
+    pagemap_reads++;
+    pagemap_bytes += res;
+    for (uptr i = 0; i < n; ++i, addr += page_size) {
+      bool resident = (buf[i] >> 63) & 1;
+      if (resident) {
+        addrs.push_back(addr);
+        pfns.push_back(buf[i] & kPfnMask);
+      }
     }
-    uptr v = buf[buf_idx];
-    bool resident = (v >> 63) & 1;
-    if (resident) {
-      uptr pfn = v & kPfnMask;
-      if (!PFR->IsZeroPage(pfn)) {
-        ++num_resident;
-        pfns.insert(pfn);
-        resident_pages.push_back(addr);
+  }
+  // Whether a page is the zero page is a property of its PFN, so a chunk with
+  // the same (addr, pfn) pairs as last time needs no kpageflags lookups.
+  chunk->changed = addrs != chunk->addrs || pfns != chunk->pfns;
+  if (chunk->changed) {
+    chunk->addrs.swap(addrs);
+    chunk->pfns.swap(pfns);
+  }
+  return true;
+}
+
+// Compute chunk->resident from the present pages of the chunk.
+//
+// A page that continues a THP mapped by the previous page (consecutive address
+// and PFN, and still within the same naturally aligned compound page) shares
+// its flags, so a fully mapped THP takes one kpageflags lookup. Every other
+// page is looked up on its own.
+//
+// With @missing, nothing is computed; instead the PFNs that would need a
+// lookup but are not loaded yet are collected, to be prefetched in one batch.
+void classify(ScanChunk *chunk, std::vector<uptr> *missing) {
+  // A PMD-mapped THP spans one page table worth of base pages.
+  const uptr thp_pages = page_size / 8;
+  uptr thp_end_pfn = 0;
+  bool thp_zero = false;
+  for (size_t i = 0; i < chunk->pfns.size(); ++i) {
+    uptr pfn = chunk->pfns[i];
+    bool zero;
+    if (chunk->Continues(i) && pfn < thp_end_pfn) {
+      zero = thp_zero;
+    } else {
+      thp_end_pfn = 0;
+      uptr flags;
+      if (missing) {
+        if (!PFR->TryGetFlags(pfn, &flags)) {
+          missing->push_back(pfn);
+          continue;
+        }
+      } else {
+        flags = PFR->GetFlags(pfn);
       }
+      zero = (flags >> kKpfZeroPage) & 1;
+      bool compound = (flags >> kKpfCompoundHead) & 1 ||
+                      (flags >> kKpfCompoundTail) & 1;
+      if (compound && ((flags >> kKpfThp) & 1)) {
+        thp_end_pfn = (pfn / thp_pages + 1) * thp_pages;
+        thp_zero = zero;
+      }
+    }
+    if (!missing && !zero) {
+      chunk->resident.push_back(chunk->addrs[i]);
+      chunk->resident_pfns.push_back(pfn);
     }
-    ++buf_idx;
-    ofs += 8;
-    addr += 4096;
   }
 }
 
-void scan_pagemap(int pid, std::vector<Map*> &maps, Map *low_shadow, std::vector<uptr> &resident_pages) {
+// Scan the given chunks of a process's shadow and recompute @resident for the
+// ones that changed. The chunks are read by a pool of num_threads threads
+// sharing a single pagemap fd.
+bool scan_chunks(int pid, std::vector<ScanChunk> &chunks) {
   std::string pagemap = "/proc/" + std::to_string(pid) + "/pagemap";
-  FILE *fp = fopen(pagemap.c_str(), "rb");
-  assert(fp);
+  int fd = open(pagemap.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
 
-  scan(fp, low_shadow->start, low_shadow->start / 4096 * 8,
-       low_shadow->end / 4096 * 8, resident_pages);
-}
+  std::atomic<size_t> next_chunk(0);
+  std::atomic<bool> ok(true);
+  auto worker = [&]() {
+    for (size_t i; ok && (i = next_chunk++) < chunks.size();)
+      if (!scan_chunk(fd, &chunks[i]))
+        ok = false;
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min<size_t>(num_threads, chunks.size()); ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (auto &t : threads)
+    t.join();
+  close(fd);
+  if (!ok)
+    return false;
 
-static bool compare(const Map* m, uptr v) {
-  return m->end <= v;
+  // Look up the changed pages in kpageflags and drop the zero pages. Flags are
+  // fetched in two batches: first for the pages that start a run of
+  // consecutive addresses and PFNs (which is where THPs start), then for the
+  // pages which turn out not to be covered by a THP.
+  std::vector<uptr> pfns;
+  for (auto &c : chunks)
+    if (c.changed)
+      for (size_t i = 0; i < c.pfns.size(); ++i)
+        if (!c.Continues(i))
+          pfns.push_back(c.pfns[i]);
+  PFR->Prefetch(std::move(pfns));
+  pfns.clear();
+  for (auto &c : chunks)
+    if (c.changed)
+      classify(&c, &pfns);
+  PFR->Prefetch(std::move(pfns));
+  for (auto &c : chunks) {
+    if (!c.changed)
+      continue;
+    c.prev_resident.swap(c.resident);
+    c.resident.clear();
+    c.resident_pfns.clear();
+    classify(&c, nullptr);
+  }
+  return true;
 }
 
-Map *find_map(std::vector<Map*> &maps, uptr addr) {
-  auto it = std::lower_bound(maps.begin(), maps.end(), addr, compare);
-  if (it == maps.end())
-    return nullptr;
-  uptr start = (*it)->start;
-  uptr end = (*it)->end;
-  assert(addr < end);
-  if (addr < start)
-    return nullptr;
-  return *it;
+// Find the resident, non-zero pages of the given shadow mappings, in address
+// order, and optionally their PFNs.
+bool scan_pagemap(int pid, const std::vector<Range> &shadows, std::vector<uptr> &resident_pages, std::vector<uptr> *resident_pfns = nullptr) {
+  std::vector<ScanChunk> chunks = make_chunks(shadows);
+  if (!scan_chunks(pid, chunks))
+    return false;
+  for (auto &c : chunks) {
+    resident_pages.insert(resident_pages.end(), c.resident.begin(),
+                          c.resident.end());
+    if (resident_pfns)
+      resident_pfns->insert(resident_pfns->end(), c.resident_pfns.begin(),
+                            c.resident_pfns.end());
+  }
+  return true;
 }
 
 // Map resident shadow pages back to user pages, and associate those with user
@@ -171,23 +398,42 @@ Map *find_map(std::vector<Map*> &maps, uptr addr) {
 // outside of a mapping (or within a non-read-write mapping), but still within
 // shadow granularity.
 //
+// @resident_shadow_pages must be sorted, so the user pages are visited in
+// address order too. That makes this a single merge-style sweep over the pages
+// and the (sorted) maps rather than a binary search per user page.
+//
+// The counts are added to @shadow_pages, which has an entry per mapping.
+//
 // Return the number of pages that were not within or nearby an r-or-w mapping.
-uptr do_magic(uptr base, std::vector<Map*> &maps, std::vector<uptr> &resident_shadow_pages) {
+// With @subtract, take the pages away from the mappings instead, undoing an
+// earlier call with the same arguments.
+uptr do_magic(uptr base, const MapTable &maps, std::vector<uptr> &shadow_pages, const std::vector<uptr> &resident_shadow_pages, bool subtract = false) {
+  constexpr size_t kNone = -1;
+  const uptr sign = subtract ? -1 : 1;
   uptr unallocated = 0;
+  if (resident_shadow_pages.empty())
+    return 0;
+  assert(std::is_sorted(resident_shadow_pages.begin(),
+                        resident_shadow_pages.end()));
+  const uptr ratio = (uptr)1 << shadow_scale;
+  size_t i = maps.LowerBound((resident_shadow_pages[0] - base) << shadow_scale);
   for (uptr shadow : resident_shadow_pages) {
-    uptr user0 = (shadow - base) * 16;
+    uptr user0 = (shadow - base) << shadow_scale;
     uptr unknown_pages = 0;
-    Map *last_map = nullptr;
-    for (uptr x = 0; x < 16; ++x) {
-      uptr user = user0 + x * 4096;
-      Map *m = find_map(maps, user);
-      if (m && (m->prot & (PROT_READ | PROT_WRITE)) == 0) m = nullptr;
-      if (m) {
-        m->shadow_pages += (1 + unknown_pages);
+    size_t last_map = kNone;
+    for (uptr x = 0; x < ratio; ++x) {
+      uptr user = user0 + x * page_size;
+      while (i < maps.size() && maps.end[i] <= user)
+        ++i;
+      size_t m = (i < maps.size() && maps.start[i] <= user) ? i : kNone;
+      if (m != kNone && (maps.prot[m] & (PROT_READ | PROT_WRITE)) == 0)
+        m = kNone;
+      if (m != kNone) {
+        shadow_pages[m] += sign * (1 + unknown_pages);
         unknown_pages = 0;
         last_map = m;
-      } else if (last_map) {
-        last_map->shadow_pages++;
+      } else if (last_map != kNone) {
+        shadow_pages[last_map] += sign;
       } else {
         unknown_pages++;
       }
@@ -197,63 +443,875 @@ uptr do_magic(uptr base, std::vector<Map*> &maps, std::vector<uptr> &resident_sh
   return unallocated;
 }
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    fprintf(stderr, "arg required\n");
-    return 1;
+// Everything scan learns about one process.
+struct Process {
+  static constexpr size_t kNoMap = -1;
+
+  int pid;
+  std::string exe;
+  MapTable maps;
+  // Per mapping: the number of user pages whose shadow is resident.
+  std::vector<uptr> shadow_pages;
+  size_t low_shadow = kNoMap;
+  size_t high_shadow = kNoMap;
+  uptr resident_shadow_pages = 0;
+  uptr unallocated = 0;
+  // With -d, the PFNs of the resident shadow pages; with -k, also a hash of
+  // their content (kNoHash if it could not be read). See count_sharing().
+  std::vector<uptr> resident_pfns;
+  std::vector<uint64_t> content_hashes;
+
+  // The number of user pages described by the resident shadow.
+  uptr TotalPages() const { return resident_shadow_pages << shadow_scale; }
+
+  void ReadMaps() {
+    maps.Read(pid);
+    shadow_pages.assign(maps.size(), 0);
+    low_shadow = high_shadow = kNoMap;
   }
-  int pid = atoi(argv[1]);
 
-  PFR = new PageFlagsReader();
+  Range LowShadow() const {
+    return {maps.start[low_shadow], maps.end[low_shadow]};
+  }
+  Range HighShadow() const {
+    return {maps.start[high_shadow], maps.end[high_shadow]};
+  }
+};
 
-  std::vector<Map*> maps;
-  read_maps(pid, maps);
+bool find_shadow(Process *p) {
+  for (size_t i = 0; i < p->maps.size(); ++i) {
+    if (p->maps.NameIs(i, "[anon:low shadow]")) {
+      p->low_shadow = i;
+    } else if (p->maps.NameIs(i, "[anon:high shadow]")) {
+      p->high_shadow = i;
+    }
+  }
+  return p->low_shadow != Process::kNoMap && p->high_shadow != Process::kNoMap;
+}
 
-  printf("========================================\n");
-  printf("     start           end       RSS   PSS\n");
-  for (auto *map : maps)
-    printf("%10lx .. %10lx %c%c%c %5lu %5lu %s\n", map->start, map->end,
-           (map->prot & PROT_READ) ? 'r' : '-',
-           (map->prot & PROT_WRITE) ? 'w' : '-',
-           (map->prot & PROT_EXEC) ? 'x' : '-', map->rss, map->pss,
-           map->name.c_str());
-
-  Map *low_shadow = nullptr;
-  Map *high_shadow = nullptr;
-  for (auto *map : maps) {
-    if (map->name == "[anon:low shadow]") {
-      low_shadow = map;
-    } else if (map->name == "[anon:high shadow]") {
-      high_shadow = map;
+std::string read_exe(int pid) {
+  char exe[PATH_MAX];
+  ssize_t exe_size = readlink(
+      ("/proc/" + std::to_string(pid) + "/exe").c_str(), exe, sizeof(exe));
+  if (exe_size < 0)
+    return "";
+  return std::string(exe, exe_size);
+}
+
+// Cheap check for HWASAN, only reading /proc/<pid>/maps.
+bool has_shadow(int pid) {
+  SmapsReader maps(pid, "maps");
+  SmapsEntry e;
+  bool low = false, high = false;
+  while (maps.Next(&e)) {
+    low |= e.NameIs("[anon:low shadow]");
+    high |= e.NameIs("[anon:high shadow]");
+  }
+  return low && high;
+}
+
+// Open-addressing hash table counting occurrences of 64-bit keys, with linear
+// probing over flat arrays. With tens of millions of shadow pages a node-based
+// set costs more than the pages' own pagemap entries and a cache miss per
+// insert; this is 12 bytes per slot and is sized up front from the expected
+// number of keys, so it normally never rehashes.
+class CountTable {
+  static constexpr uint64_t kEmpty = ~(uint64_t)0;
+
+  std::vector<uint64_t> keys;
+  std::vector<uint32_t> counts;
+  size_t used = 0;
+
+  static size_t Hash(uint64_t key) {
+    // Finalizer of MurmurHash3; PFNs are dense, so they need mixing.
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+  }
+
+  void Resize(size_t capacity) {
+    std::vector<uint64_t> old_keys(capacity, kEmpty);
+    std::vector<uint32_t> old_counts(capacity);
+    old_keys.swap(keys);
+    old_counts.swap(counts);
+    used = 0;
+    for (size_t i = 0; i < old_keys.size(); ++i)
+      if (old_keys[i] != kEmpty)
+        Slot(old_keys[i]) = old_counts[i];
+  }
+
+  uint32_t &Slot(uint64_t key) {
+    size_t mask = keys.size() - 1;
+    size_t i = Hash(key) & mask;
+    while (keys[i] != key && keys[i] != kEmpty)
+      i = (i + 1) & mask;
+    if (keys[i] == kEmpty) {
+      keys[i] = key;
+      used++;
+    }
+    return counts[i];
+  }
+
+ public:
+  // Room for @expected keys at a load factor of at most 1/2.
+  explicit CountTable(size_t expected) {
+    size_t capacity = 16;
+    while (capacity < expected * 2)
+      capacity *= 2;
+    Resize(capacity);
+  }
+
+  // Count one more occurrence of @key, which must not be ~0, and return the
+  // new count.
+  uint32_t Add(uint64_t key) {
+    assert(key != kEmpty);
+    if ((used + 1) * 2 > keys.size())
+      Resize(keys.size() * 2);
+    return ++Slot(key);
+  }
+
+  // Number of distinct keys.
+  size_t size() const { return used; }
+};
+
+// Set by -d and -k.
+bool report_sharing = false;
+bool hash_content = false;
+
+constexpr uint64_t kNoHash = ~(uint64_t)0;
+
+// Hash the content of the given pages of process @pid, read from
+// /proc/<pid>/mem, into @hashes (one per page, kNoHash for pages that could
+// not be read). Runs of consecutive pages are read with one pread() each.
+void hash_pages(int pid, const std::vector<uptr> &pages,
+                std::vector<uint64_t> *hashes) {
+  constexpr size_t kMaxRun = 64;
+  hashes->assign(pages.size(), kNoHash);
+  std::string mem = "/proc/" + std::to_string(pid) + "/mem";
+  int fd = open(mem.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  const size_t words = page_size / sizeof(uint64_t);
+  std::vector<uint64_t> buf(kMaxRun * words);
+  for (size_t i = 0; i < pages.size();) {
+    size_t j = i + 1;
+    while (j < pages.size() && j - i < kMaxRun &&
+           pages[j] == pages[j - 1] + page_size)
+      ++j;
+    ssize_t res = pread(fd, buf.data(), (j - i) * page_size, pages[i]);
+    size_t n = res > 0 ? res / page_size : 0;
+    for (size_t k = 0; k < n; ++k) {
+      // Word-at-a-time FNV-1a: plenty for telling pages apart, and fast
+      // enough not to matter next to the read itself. All-zero pages hash
+      // to 0 so they can be counted separately.
+      const uint64_t *w = &buf[k * words];
+      uint64_t h = 0xcbf29ce484222325ULL, any = 0;
+      for (size_t x = 0; x < words; ++x) {
+        h = (h ^ w[x]) * 0x100000001b3ULL;
+        any |= w[x];
+      }
+      h = any ? h : 0;
+      (*hashes)[i + k] = h == kNoHash ? h - 1 : h;
     }
+    // On a short or failed read, skip the page that could not be read.
+    i += n ? n : 1;
+  }
+  close(fd);
+}
+
+// Sharing of resident shadow pages, for -d and -k.
+struct Sharing {
+  // Resident shadow pages, summed over the mappings of all the processes.
+  uptr mapped = 0;
+  // Distinct physical pages among them, and how many of those are mapped more
+  // than once.
+  uptr distinct = 0;
+  uptr shared = 0;
+  // With -k: distinct physical pages whose content could be read, how many
+  // distinct contents they hold, and how many of them are all zeroes.
+  uptr hashed = 0;
+  uptr distinct_content = 0;
+  uptr zero_filled = 0;
+};
+
+Sharing count_sharing(const std::vector<const Process *> &procs) {
+  Sharing s;
+  for (const Process *p : procs)
+    s.mapped += p->resident_pfns.size();
+  CountTable pfns(s.mapped);
+  CountTable contents(hash_content ? s.mapped : 0);
+  for (const Process *p : procs) {
+    for (size_t i = 0; i < p->resident_pfns.size(); ++i) {
+      uint32_t n = pfns.Add(p->resident_pfns[i]);
+      if (n == 2)
+        s.shared++;
+      // Content is a property of the physical page: hash each one once.
+      if (n != 1 || p->content_hashes.empty() ||
+          p->content_hashes[i] == kNoHash)
+        continue;
+      s.hashed++;
+      if (p->content_hashes[i] == 0)
+        s.zero_filled++;
+      contents.Add(p->content_hashes[i]);
+    }
+  }
+  s.distinct = pfns.size();
+  s.distinct_content = contents.size();
+  return s;
+}
+
+void print_sharing(FILE *out, const Sharing &s) {
+  fprintf(out,
+          "Shadow sharing: %lu pages mapped, %lu distinct, %lu shared "
+          "(%lu kB saved by sharing)\n",
+          s.mapped, s.distinct, s.shared, pages_to_kb(s.mapped - s.distinct));
+  if (!hash_content)
+    return;
+  fprintf(out,
+          "Shadow content: %lu pages hashed, %lu distinct, %lu zero-filled "
+          "(KSM could save %lu kB)\n",
+          s.hashed, s.distinct_content, s.zero_filled,
+          pages_to_kb(s.hashed - s.distinct_content));
+}
+
+// Scan the shadow of a process whose maps have been read, and attribute it to
+// the user mappings. Returns false if the process went away.
+bool scan_shadow(Process *p) {
+  std::vector<uptr> resident_shadow_pages;
+  if (!scan_pagemap(p->pid, {p->LowShadow(), p->HighShadow()},
+                    resident_shadow_pages,
+                    report_sharing ? &p->resident_pfns : nullptr))
+    return false;
+  p->resident_shadow_pages = resident_shadow_pages.size();
+  uptr base = p->LowShadow().first;
+  p->unallocated =
+      do_magic(base, p->maps, p->shadow_pages, resident_shadow_pages);
+  if (hash_content)
+    hash_pages(p->pid, resident_shadow_pages, &p->content_hashes);
+  return true;
+}
+
+// Structured output (-o): one record per mapping followed by a summary record
+// per process. Records are written as soon as a process has been scanned, so
+// nothing is kept around in -a mode. All sizes are in the units scan uses
+// internally: rss and pss in kB, shadow_pages, unaccounted and total in user
+// pages whose shadow is resident.
+class Output {
+ protected:
+  FILE *out = stdout;
+
+  static const char *ProtString(unsigned prot) {
+    static const char *kProt[] = {"---", "r--", "-w-", "rw-",
+                                  "--x", "r-x", "-wx", "rwx"};
+    return kProt[prot & 7];
   }
 
-  if (!low_shadow || !high_shadow) {
+ public:
+  virtual ~Output() {}
+  virtual void Mapping(const Process &p, size_t i) = 0;
+  virtual void Summary(const Process &p) = 0;
+
+  void Write(const Process &p) {
+    for (size_t i = 0; i < p.maps.size(); ++i)
+      Mapping(p, i);
+    Summary(p);
+    fflush(out);
+  }
+
+  // For -i: only the mappings whose shadow changed since the last sample.
+  void WriteChanged(const Process &p, const std::vector<size_t> &changed) {
+    for (size_t i : changed)
+      Mapping(p, i);
+    Summary(p);
+    fflush(out);
+  }
+};
+
+// JSON Lines: one object per line.
+class JsonOutput : public Output {
+  void String(std::string_view s) {
+    fputc('"', out);
+    for (unsigned char c : s) {
+      if (c == '"' || c == '\\')
+        fprintf(out, "\\%c", c);
+      else if (c < 0x20)
+        fprintf(out, "\\u%04x", c);
+      else
+        fputc(c, out);
+    }
+    fputc('"', out);
+  }
+
+ public:
+  void Mapping(const Process &p, size_t i) override {
+    const MapTable &m = p.maps;
+    fprintf(out,
+            "{\"type\":\"map\",\"pid\":%d,\"start\":%lu,\"end\":%lu,"
+            "\"prot\":\"%s\",\"rss\":%lu,\"pss\":%lu,\"shadow_pages\":%lu,"
+            "\"name\":",
+            p.pid, m.start[i], m.end[i], ProtString(m.prot[i]), m.rss[i],
+            m.pss[i], p.shadow_pages[i]);
+    String(m.NameView(i));
+    fputs("}\n", out);
+  }
+
+  void Summary(const Process &p) override {
+    fprintf(out, "{\"type\":\"process\",\"pid\":%d,\"exe\":", p.pid);
+    String(p.exe);
+    fprintf(out,
+            ",\"resident_shadow_pages\":%lu,\"unaccounted\":%lu,"
+            "\"total\":%lu}\n",
+            p.resident_shadow_pages, p.unallocated,
+            p.TotalPages());
+  }
+};
+
+// CSV with a header; the first column tells map and process rows apart.
+class CsvOutput : public Output {
+  void String(std::string_view s) {
+    fputc('"', out);
+    for (char c : s) {
+      if (c == '"')
+        fputc('"', out);
+      fputc(c, out);
+    }
+    fputc('"', out);
+  }
+
+ public:
+  CsvOutput() {
+    fputs("type,pid,start,end,prot,rss,pss,shadow_pages,unaccounted,total,"
+          "name\n",
+          out);
+  }
+
+  void Mapping(const Process &p, size_t i) override {
+    const MapTable &m = p.maps;
+    fprintf(out, "map,%d,%lu,%lu,%s,%lu,%lu,%lu,,,", p.pid, m.start[i],
+            m.end[i], ProtString(m.prot[i]), m.rss[i], m.pss[i],
+            p.shadow_pages[i]);
+    String(m.NameView(i));
+    fputc('\n', out);
+  }
+
+  void Summary(const Process &p) override {
+    fprintf(out, "process,%d,,,,,,%lu,%lu,%lu,", p.pid,
+            p.resident_shadow_pages, p.unallocated,
+            p.TotalPages());
+    String(p.exe);
+    fputc('\n', out);
+  }
+};
+
+// Protocol buffer wire format. The stream as a whole is a valid encoding of
+//
+//   message Map {
+//     int32 pid = 1; uint64 start = 2; uint64 end = 3; uint32 prot = 4;
+//     uint64 rss = 5; uint64 pss = 6; uint64 shadow_pages = 7; bytes name = 8;
+//   }
+//   message Process {
+//     int32 pid = 1; bytes exe = 2; uint64 resident_shadow_pages = 3;
+//     uint64 unaccounted = 4; uint64 total = 5;
+//   }
+//   message ScanResult {
+//     repeated Map map = 1;
+//     repeated Process process = 2;
+//   }
+//
+// and can be read incrementally as a sequence of length-delimited records.
+class BinaryOutput : public Output {
+  std::string msg;
+
+  static void Varint(std::string &buf, uint64_t v) {
+    while (v >= 0x80) {
+      buf.push_back((char)(v | 0x80));
+      v >>= 7;
+    }
+    buf.push_back((char)v);
+  }
+
+  static void Field(std::string &buf, unsigned field, uint64_t v) {
+    Varint(buf, field << 3);
+    Varint(buf, v);
+  }
+
+  static void Field(std::string &buf, unsigned field, std::string_view v) {
+    Varint(buf, (field << 3) | 2);
+    Varint(buf, v.size());
+    buf += v;
+  }
+
+  void Emit(unsigned field) {
+    std::string header;
+    Varint(header, (field << 3) | 2);
+    Varint(header, msg.size());
+    fwrite(header.data(), 1, header.size(), out);
+    fwrite(msg.data(), 1, msg.size(), out);
+    msg.clear();
+  }
+
+ public:
+  void Mapping(const Process &p, size_t i) override {
+    const MapTable &m = p.maps;
+    Field(msg, 1, p.pid);
+    Field(msg, 2, m.start[i]);
+    Field(msg, 3, m.end[i]);
+    Field(msg, 4, m.prot[i]);
+    Field(msg, 5, m.rss[i]);
+    Field(msg, 6, m.pss[i]);
+    Field(msg, 7, p.shadow_pages[i]);
+    Field(msg, 8, m.NameView(i));
+    Emit(1);
+  }
+
+  void Summary(const Process &p) override {
+    Field(msg, 1, p.pid);
+    Field(msg, 2, p.exe);
+    Field(msg, 3, p.resident_shadow_pages);
+    Field(msg, 4, p.unallocated);
+    Field(msg, 5, p.TotalPages());
+    Emit(2);
+  }
+};
+
+// Set with -o; nullptr means the human-readable tables.
+Output *output;
+
+static double now_ms() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void print_stats(double start_ms) {
+  PageFlagsReader::Stats stats = PFR->GetStats();
+  fprintf(stderr,
+          "scan: %.1f ms, %u threads, pagemap: %lu reads, %lu bytes, "
+          "kpageflags: %lu reads, %lu bytes, %lu lookups\n",
+          now_ms() - start_ms, num_threads, pagemap_reads.load(),
+          pagemap_bytes.load(), stats.syscalls, stats.bytes, stats.lookups);
+}
+
+int scan_one(int pid, bool stats) {
+  Process p;
+  p.pid = pid;
+  p.exe = read_exe(pid);
+  p.ReadMaps();
+
+  if (output) {
+    if (!find_shadow(&p)) {
+      fprintf(stderr, "shadow mapping not found\n");
+      return 1;
+    }
+    double scan_start = now_ms();
+    if (!scan_shadow(&p)) {
+      fprintf(stderr, "failed to read pagemap\n");
+      return 1;
+    }
+    if (stats)
+      print_stats(scan_start);
+    output->Write(p);
+    if (report_sharing)
+      print_sharing(stderr, count_sharing({&p}));
+    return 0;
+  }
+
+  printf("========================================\n");
+  printf("     start           end       RSS   PSS\n");
+  const MapTable &maps = p.maps;
+  for (size_t i = 0; i < maps.size(); ++i)
+    printf("%10lx .. %10lx %c%c%c %5lu %5lu %s\n", maps.start[i], maps.end[i],
+           (maps.prot[i] & PROT_READ) ? 'r' : '-',
+           (maps.prot[i] & PROT_WRITE) ? 'w' : '-',
+           (maps.prot[i] & PROT_EXEC) ? 'x' : '-', maps.rss[i], maps.pss[i],
+           maps.Name(i));
+
+  if (!find_shadow(&p)) {
     fprintf(stderr, "shadow mapping not found\n");
     return 1;
   }
 
   printf("========================================\n");
-  printf("Low shadow: %zx .. %zx\n", low_shadow->start, low_shadow->end);
-  printf("High shadow: %zx .. %zx\n", high_shadow->start, high_shadow->end);
-
-  std::vector<uptr> resident_shadow_pages;
-  scan_pagemap(pid, maps, low_shadow, resident_shadow_pages);
-  scan_pagemap(pid, maps, high_shadow, resident_shadow_pages);
-  printf("%lu resident shadow pages\n", resident_shadow_pages.size());
+  printf("Low shadow: %zx .. %zx\n", p.LowShadow().first, p.LowShadow().second);
+  printf("High shadow: %zx .. %zx\n", p.HighShadow().first, p.HighShadow().second);
 
-  uptr base = low_shadow->start;
-  uptr unallocated = do_magic(base, maps, resident_shadow_pages);
+  double scan_start = now_ms();
+  if (!scan_shadow(&p)) {
+    fprintf(stderr, "failed to read pagemap\n");
+    return 1;
+  }
+  printf("%lu resident shadow pages\n", p.resident_shadow_pages);
+  if (stats)
+    print_stats(scan_start);
 
   printf("==============================================\n");
   printf("     start           end      size   RSS  SRSS\n");
-  for (auto *map : maps) {
-    if (map->shadow_pages == 0)
+  for (size_t i = 0; i < maps.size(); ++i) {
+    if (p.shadow_pages[i] == 0)
+      continue;
+    printf("%10lx .. %10lx  %8lu %5lu %5lu %s\n", maps.start[i], maps.end[i],
+           (maps.end[i] - maps.start[i]) / 1024, maps.rss[i],
+           pages_to_kb(p.shadow_pages[i]), maps.Name(i));
+  }
+
+  printf("Shadow RSS: %lu unaccounted, %lu total\n", p.unallocated, p.TotalPages());
+  if (report_sharing)
+    print_sharing(stdout, count_sharing({&p}));
+  return 0;
+}
+
+// Scan every HWASAN process on the host, @procs at a time, and print a table
+// per process and a table per mapping name.
+int scan_all(unsigned procs, bool stats) {
+  DIR *proc = opendir("/proc");
+  if (!proc) {
+    perror("opendir");
+    return 1;
+  }
+  std::vector<int> pids;
+  while (dirent *ent = readdir(proc)) {
+    char *end;
+    int pid = strtol(ent->d_name, &end, 10);
+    if (*end != 0 || pid == getpid())
+      continue;
+    pids.push_back(pid);
+  }
+  closedir(proc);
+  std::sort(pids.begin(), pids.end());
+
+  double scan_start = now_ms();
+  std::mutex output_mu;
+  std::vector<std::unique_ptr<Process>> results(pids.size());
+  std::atomic<size_t> next_pid(0);
+  auto worker = [&]() {
+    for (size_t i; (i = next_pid++) < pids.size();) {
+      int pid = pids[i];
+      if (!has_shadow(pid))
+        continue;
+      std::unique_ptr<Process> p(new Process);
+      p->pid = pid;
+      p->exe = read_exe(pid);
+      if (p->exe.empty())
+        continue;
+      p->ReadMaps();
+      if (!find_shadow(p.get()) || !scan_shadow(p.get()))
+        continue;
+      if (output) {
+        std::lock_guard<std::mutex> lock(output_mu);
+        output->Write(*p);
+        if (!report_sharing)
+          continue;
+        // Only the pages are needed for the sharing report.
+        p->maps.Clear();
+        p->shadow_pages.clear();
+      }
+      results[i] = std::move(p);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min<size_t>(procs, pids.size()); ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (auto &t : threads)
+    t.join();
+  if (stats)
+    print_stats(scan_start);
+  std::vector<const Process *> scanned;
+  for (auto &p : results)
+    if (p)
+      scanned.push_back(p.get());
+  if (output) {
+    if (report_sharing)
+      print_sharing(stderr, count_sharing(scanned));
+    return 0;
+  }
+
+  struct NameTotals {
+    uptr maps, rss, shadow_pages;
+  };
+  std::map<std::string, NameTotals> by_name;
+  uptr total = 0, unallocated = 0;
+
+  printf("==============================================\n");
+  printf("    pid      SRSS unaccounted exe\n");
+  for (auto &p : results) {
+    if (!p)
+      continue;
+    printf("%7d %9lu %11lu %s\n", p->pid,
+           pages_to_kb(p->TotalPages()), pages_to_kb(p->unallocated),
+           p->exe.c_str());
+    total += p->TotalPages();
+    unallocated += p->unallocated;
+    for (size_t i = 0; i < p->maps.size(); ++i) {
+      if (p->shadow_pages[i] == 0)
+        continue;
+      NameTotals &t = by_name[std::string(p->maps.NameView(i))];
+      t.maps++;
+      t.rss += p->maps.rss[i];
+      t.shadow_pages += p->shadow_pages[i];
+    }
+  }
+
+  printf("==============================================\n");
+  printf("  maps       RSS      SRSS name\n");
+  for (auto &it : by_name)
+    printf("%6lu %9lu %9lu %s\n", it.second.maps, it.second.rss,
+           pages_to_kb(it.second.shadow_pages), it.first.c_str());
+
+  printf("Shadow RSS: %lu kB unaccounted, %lu kB total\n",
+         pages_to_kb(unallocated), pages_to_kb(total));
+  if (report_sharing)
+    print_sharing(stdout, count_sharing(scanned));
+  return 0;
+}
+
+// State kept between the samples of one process in -i mode.
+struct Sampler {
+  Process p;
+  std::vector<ScanChunk> chunks;
+  // The shadow mappings the chunks were made for.
+  Range low = {0, 0}, high = {0, 0};
+};
+
+// Whether /proc/<pid>/maps still lists exactly the mappings in @maps. This is
+// much cheaper than re-reading smaps, which walks the page tables of every
+// mapping to count RSS.
+bool same_maps(int pid, const MapTable &maps) {
+  SmapsReader reader(pid, "maps");
+  if (!reader.ok())
+    return false;
+  SmapsEntry e;
+  size_t i = 0;
+  for (; reader.Next(&e); ++i) {
+    if (i == maps.size())
+      return false;
+    if (maps.start[i] != e.start || maps.end[i] != e.end ||
+        maps.prot[i] != e.prot ||
+        maps.NameView(i) != std::string_view(e.name, e.name_len))
+      return false;
+  }
+  return i == maps.size();
+}
+
+// Take one sample of the process and print what changed since the previous
+// one. Returns false if the process is gone.
+//
+// If the mapping list is unchanged, the RSS/PSS numbers from the last smaps
+// read are kept and only the shadow chunks whose pagemap entries changed are
+// attributed again, by first subtracting their old pages from the mappings.
+// Otherwise smaps is re-read and everything is attributed from scratch.
+bool sample(Sampler *s, double start_ms) {
+  Process &p = s->p;
+  double sample_start = now_ms();
+  bool first = p.maps.size() == 0;
+  bool maps_changed = first || !same_maps(p.pid, p.maps);
+
+  // Shadow per mapping before this sample, to compute the deltas.
+  std::map<std::tuple<uptr, uptr, std::string>, uptr> before;
+  std::vector<uptr> before_same;
+  if (maps_changed) {
+    for (size_t i = 0; i < p.maps.size(); ++i)
+      if (p.shadow_pages[i])
+        before[std::make_tuple(p.maps.start[i], p.maps.end[i],
+                               std::string(p.maps.NameView(i)))] =
+            p.shadow_pages[i];
+    p.ReadMaps();
+    if (!find_shadow(&p))
+      return false;
+    if (p.LowShadow() != s->low || p.HighShadow() != s->high) {
+      s->low = p.LowShadow();
+      s->high = p.HighShadow();
+      s->chunks = make_chunks({s->low, s->high});
+    }
+  } else {
+    before_same = p.shadow_pages;
+  }
+  uptr prev_total = p.TotalPages();
+  uptr prev_unallocated = p.unallocated;
+
+  if (!scan_chunks(p.pid, s->chunks))
+    return false;
+
+  uptr base = p.LowShadow().first;
+  size_t rescanned = 0;
+  p.resident_shadow_pages = 0;
+  if (maps_changed)
+    p.unallocated = 0;
+  for (auto &c : s->chunks) {
+    p.resident_shadow_pages += c.resident.size();
+    if (maps_changed) {
+      p.unallocated += do_magic(base, p.maps, p.shadow_pages, c.resident);
+    } else if (c.changed) {
+      p.unallocated -=
+          do_magic(base, p.maps, p.shadow_pages, c.prev_resident, true);
+      p.unallocated += do_magic(base, p.maps, p.shadow_pages, c.resident);
+    }
+    if (c.changed)
+      rescanned++;
+    c.prev_resident.clear();
+  }
+
+  std::vector<size_t> changed;
+  std::vector<long> deltas;
+  for (size_t i = 0; i < p.maps.size(); ++i) {
+    uptr old = 0;
+    if (maps_changed) {
+      auto it = before.find(std::make_tuple(
+          p.maps.start[i], p.maps.end[i], std::string(p.maps.NameView(i))));
+      if (it != before.end()) {
+        old = it->second;
+        before.erase(it);
+      }
+    } else {
+      old = before_same[i];
+    }
+    if (p.shadow_pages[i] != old || first) {
+      changed.push_back(i);
+      deltas.push_back((long)(p.shadow_pages[i] - old));
+    }
+  }
+
+  if (output) {
+    output->WriteChanged(p, changed);
+    return true;
+  }
+
+  uptr total = p.TotalPages();
+  printf("[%.3f] pid %d: %lu total (%+ld), %lu unaccounted (%+ld), "
+         "%zu/%zu chunks rescanned%s, %.1f ms\n",
+         (sample_start - start_ms) / 1000, p.pid, total,
+         (long)(total - prev_total), p.unallocated,
+         (long)(p.unallocated - prev_unallocated), rescanned, s->chunks.size(),
+         maps_changed ? ", maps changed" : "", now_ms() - sample_start);
+  for (size_t i = 0; i < changed.size(); ++i) {
+    size_t m = changed[i];
+    if (!deltas[i])
       continue;
-    printf("%10lx .. %10lx  %8lu %5lu %5lu %s\n", map->start, map->end,
-           (map->end - map->start) / 1024, map->rss,
-           map->shadow_pages * 4096 / 1024, map->name.c_str());
+    printf("  %10lx .. %10lx  SRSS %+ld kB %s\n", p.maps.start[m],
+           p.maps.end[m], deltas[i] * (long)page_size / 1024, p.maps.Name(m));
+  }
+  // Mappings that went away together with their shadow.
+  for (auto &it : before)
+    printf("  %10lx .. %10lx  SRSS %+ld kB %s (unmapped)\n",
+           std::get<0>(it.first), std::get<1>(it.first),
+           -(long)pages_to_kb(it.second), std::get<2>(it.first).c_str());
+  fflush(stdout);
+  return true;
+}
+
+// Sample the given processes every @interval_ms until they all exit, or
+// @count samples have been taken (0 for no limit).
+int sample_loop(const std::vector<int> &pids, double interval_ms, unsigned count) {
+  std::vector<std::unique_ptr<Sampler>> samplers;
+  for (int pid : pids) {
+    samplers.emplace_back(new Sampler);
+    samplers.back()->p.pid = pid;
+    samplers.back()->p.exe = read_exe(pid);
+  }
+
+  double start = now_ms();
+  for (unsigned n = 0; count == 0 || n < count; ++n) {
+    for (auto &s : samplers) {
+      if (s && !sample(s.get(), start)) {
+        fprintf(stderr, "pid %d: gone or not a HWASAN process\n", s->p.pid);
+        s.reset();
+      }
+    }
+    if (std::none_of(samplers.begin(), samplers.end(),
+                     [](const std::unique_ptr<Sampler> &s) { return !!s; }))
+      return 1;
+    double next = start + (n + 1) * interval_ms;
+    double delay = next - now_ms();
+    if (delay > 0 && (count == 0 || n + 1 < count)) {
+      timespec ts = {(time_t)(delay / 1000), (long)(fmod(delay, 1000) * 1e6)};
+      while (nanosleep(&ts, &ts) && errno == EINTR) {
+      }
+    }
   }
+  return 0;
+}
 
-  printf("Shadow RSS: %lu unaccounted, %lu total\n", unallocated, resident_shadow_pages.size() * 16);
+int main(int argc, char **argv) {
+  bool stats = false;
+  bool all = false;
+  double interval_ms = 0;
+  unsigned count = 0;
+  unsigned procs = std::max(1u, std::thread::hardware_concurrency());
+  num_threads = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "taj:P:o:i:n:s:dk")) != -1) {
+    switch (opt) {
+      case 't':
+        stats = true;
+        break;
+      case 'a':
+        all = true;
+        break;
+      case 'j':
+        num_threads = std::max(1, atoi(optarg));
+        break;
+      case 'P':
+        procs = std::max(1, atoi(optarg));
+        break;
+      case 'i':
+        interval_ms = atof(optarg) * 1000;
+        break;
+      case 'n':
+        count = atoi(optarg);
+        break;
+      case 's':
+        shadow_scale = atoi(optarg);
+        break;
+      case 'k':
+        hash_content = true;
+        report_sharing = true;
+        break;
+      case 'd':
+        report_sharing = true;
+        break;
+      case 'o':
+        if (!strcmp(optarg, "json")) {
+          output = new JsonOutput();
+        } else if (!strcmp(optarg, "csv")) {
+          output = new CsvOutput();
+        } else if (!strcmp(optarg, "bin")) {
+          output = new BinaryOutput();
+        } else if (strcmp(optarg, "text")) {
+          fprintf(stderr, "unknown output format: %s\n", optarg);
+          return 1;
+        }
+        break;
+      default:
+        fprintf(stderr,
+                "usage: %s [-t] [-j threads] [-o format] [-s scale] [-d | -k] "
+                "(pid | -a [-P procs] | -i seconds [-n count] pid...)\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (!all && optind >= argc) {
+    fprintf(stderr, "arg required\n");
+    return 1;
+  }
+
+  // By default use all the CPUs, split between the processes scanned at once.
+  if (!num_threads)
+    num_threads = std::max(1u, std::thread::hardware_concurrency() /
+                                   (all ? procs : 1));
+
+  page_size = sysconf(_SC_PAGESIZE);
+  PFR = new PageFlagsReader();
+
+  if (all)
+    return scan_all(procs, stats);
+  if (interval_ms > 0) {
+    std::vector<int> pids;
+    for (int i = optind; i < argc; ++i)
+      pids.push_back(atoi(argv[i]));
+    return sample_loop(pids, interval_ms, count);
+  }
+  return scan_one(atoi(argv[optind]), stats);
 }
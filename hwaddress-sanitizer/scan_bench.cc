@@ -0,0 +1,119 @@
+// scan_bench: time do_magic() from scan.cc, the merge sweep attributing
+// resident shadow pages to mappings, against the binary search per user page
+// (find_map()) it replaced.
+//
+// Usage: scan_bench [maps] [resident shadow pages]
+//   Builds a synthetic MapTable of that many mappings (default: 1M) with gaps
+//   and PROT_NONE guards between them, and a sorted list of that many resident
+//   shadow pages (default: 234k) spread over them. Both versions run over the
+//   same input; their per-mapping counts and unaccounted totals are compared.
+//
+// Build: g++ -O2 -pthread scan_bench.cc -o scan_bench
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Benchmark the code as scan builds it.
+#define main scan_main
+#include "scan.cc"
+#undef main
+
+// Repeat each version this many times and keep the fastest run.
+constexpr int kRuns = 5;
+
+// do_magic() as it was before the merge sweep: a binary search over the maps
+// for every user page.
+uptr do_magic_find_map(uptr base, const MapTable &maps,
+                       std::vector<uptr> &shadow_pages,
+                       const std::vector<uptr> &resident_shadow_pages) {
+  constexpr size_t kNone = -1;
+  auto find_map = [&](uptr addr) {
+    size_t i = maps.LowerBound(addr);
+    if (i == maps.size() || addr < maps.start[i])
+      return kNone;
+    return i;
+  };
+  uptr unallocated = 0;
+  const uptr ratio = (uptr)1 << shadow_scale;
+  for (uptr shadow : resident_shadow_pages) {
+    uptr user0 = (shadow - base) << shadow_scale;
+    uptr unknown_pages = 0;
+    size_t last_map = kNone;
+    for (uptr x = 0; x < ratio; ++x) {
+      uptr user = user0 + x * page_size;
+      size_t m = find_map(user);
+      if (m != kNone && (maps.prot[m] & (PROT_READ | PROT_WRITE)) == 0)
+        m = kNone;
+      if (m != kNone) {
+        shadow_pages[m] += 1 + unknown_pages;
+        unknown_pages = 0;
+        last_map = m;
+      } else if (last_map != kNone) {
+        shadow_pages[last_map]++;
+      } else {
+        unknown_pages++;
+      }
+    }
+    unallocated += unknown_pages;
+  }
+  return unallocated;
+}
+
+int main(int argc, char **argv) {
+  size_t num_maps = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+  size_t num_resident = argc > 2 ? strtoul(argv[2], nullptr, 10) : 234000;
+  srand(1);
+
+  // Mappings of 1 to 64 pages starting at 0x7000000000, a third of them with
+  // a gap before them and an eighth of them PROT_NONE.
+  MapTable maps;
+  SmapsEntry e = {};
+  e.name = "[anon:scudo:primary]";
+  e.name_len = strlen(e.name);
+  uptr addr = 0x7000000000;
+  for (size_t i = 0; i < num_maps; ++i) {
+    if (rand() % 3 == 0)
+      addr += page_size * (1 + rand() % 16);
+    e.start = addr;
+    e.end = addr += page_size * (1 + rand() % 64);
+    e.prot = rand() % 8 ? PROT_READ | PROT_WRITE : PROT_NONE;
+    maps.Add(e);
+  }
+
+  // The shadow of that address range, with a random sorted subset of its pages
+  // resident.
+  const uptr base = 0x1000000000;
+  uptr shadow_start =
+      base + (maps.start[0] >> shadow_scale) / page_size * page_size;
+  uptr shadow_pages = ((addr - maps.start[0]) >> shadow_scale) / page_size + 1;
+  std::vector<uptr> resident;
+  for (uptr i = 0; i < shadow_pages; ++i)
+    if ((uptr)rand() % shadow_pages < num_resident)
+      resident.push_back(shadow_start + i * page_size);
+  printf("%zu maps, %zu resident shadow pages\n", maps.size(), resident.size());
+
+  std::vector<uptr> sweep_counts, find_map_counts;
+  uptr sweep_unallocated = 0, find_map_unallocated = 0;
+  double sweep_ms = 1e100, find_map_ms = 1e100;
+  for (int run = 0; run < kRuns; ++run) {
+    find_map_counts.assign(maps.size(), 0);
+    double start = now_ms();
+    find_map_unallocated =
+        do_magic_find_map(base, maps, find_map_counts, resident);
+    find_map_ms = std::min(find_map_ms, now_ms() - start);
+
+    sweep_counts.assign(maps.size(), 0);
+    start = now_ms();
+    sweep_unallocated = do_magic(base, maps, sweep_counts, resident);
+    sweep_ms = std::min(sweep_ms, now_ms() - start);
+  }
+
+  printf("find_map per page: %8.1f ms\n", find_map_ms);
+  printf("merge sweep:       %8.1f ms (%.1fx)\n", sweep_ms,
+         find_map_ms / sweep_ms);
+  if (sweep_counts != find_map_counts ||
+      sweep_unallocated != find_map_unallocated) {
+    fprintf(stderr, "the results differ\n");
+    return 1;
+  }
+}
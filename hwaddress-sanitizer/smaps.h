@@ -0,0 +1,345 @@
+// smaps.h: streaming parser for /proc/<pid>/smaps and /proc/<pid>/maps.
+//
+// SmapsReader pulls the file through a large read() buffer and hands out one
+// SmapsEntry per mapping, with the header line and all the "Key: value kB"
+// lines that follow it decoded in a single pass. Nothing is allocated per line:
+// the mapping name is copied into a buffer owned by the reader and stays valid
+// until the next call to Next().
+//
+// The same reader handles /proc/<pid>/maps, which is just smaps without the
+// field lines (all the counters are then left at zero).
+//
+//   SmapsReader reader(pid);
+//   SmapsEntry e;
+//   while (reader.Next(&e))
+//     printf("%lx-%lx %.*s\n", e.start, e.end, (int)e.name_len, e.name);
+
+#ifndef HWADDRESS_SANITIZER_SMAPS_H
+#define HWADDRESS_SANITIZER_SMAPS_H
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Two-letter VmFlags codes, as printed by show_smap_vma_flags() in the kernel.
+// SmapsEntry::vmflags has bit i set if kVmFlagNames[i] is present.
+constexpr char kVmFlagNames[][3] = {
+    "rd", "wr", "ex", "sh", "mr", "mw", "me", "ms", "gd", "pf", "dw", "lo",
+    "io", "sr", "rr", "dc", "de", "ac", "nr", "ht", "sf", "nl", "ar", "wf",
+    "dd", "sd", "mm", "hg", "nh", "mg", "um", "uw", "ss", "sl", "bt", "mt",
+};
+
+enum : uint64_t {
+  kVmFlagMT = 1ULL << 35,  // VM_MTE: the mapping has MTE tags enabled.
+};
+
+static_assert(sizeof(kVmFlagNames) / sizeof(kVmFlagNames[0]) <= 64,
+              "VmFlags must fit into a uint64_t");
+static_assert(kVmFlagNames[35][0] == 'm' && kVmFlagNames[35][1] == 't',
+              "kVmFlagMT out of sync with kVmFlagNames");
+
+struct SmapsEntry {
+  unsigned long start, end, offset, inode;
+  // Permissions exactly as printed, e.g. "rw-p".
+  char perms[4];
+  unsigned prot;  // PROT_* bits derived from perms.
+  // Not NUL-terminated; owned by the reader.
+  const char *name;
+  size_t name_len;
+
+  // All counters are in kB, as reported by the kernel.
+  unsigned long size, kernel_page_size, mmu_page_size;
+  unsigned long rss, pss, pss_dirty;
+  unsigned long shared_clean, shared_dirty, private_clean, private_dirty;
+  unsigned long referenced, anonymous, lazy_free;
+  unsigned long anon_huge_pages, shmem_pmd_mapped, file_pmd_mapped;
+  unsigned long shared_hugetlb, private_hugetlb;
+  unsigned long swap, swap_pss, locked;
+  bool thp_eligible;
+  uint64_t vmflags;
+
+  bool NameIs(const char *s) const {
+    return strlen(s) == name_len && memcmp(name, s, name_len) == 0;
+  }
+  bool mt() const { return vmflags & kVmFlagMT; }
+};
+
+class SmapsReader {
+  // Large enough to hold any single line (names are bounded by PATH_MAX), and
+  // large enough that a 200k-mapping smaps takes only a few hundred reads.
+  static constexpr size_t kBufSize = 1 << 20;
+  static constexpr size_t kMaxName = PATH_MAX + 64;
+
+  int fd_;
+  char *buf_;
+  size_t pos_ = 0, len_ = 0;
+  bool eof_ = false;
+  unsigned long lines_ = 0;
+
+  // The header of the next entry is parsed before the current one is
+  // returned, so the names are double-buffered.
+  char names_[2][kMaxName];
+  int name_idx_ = 0;
+  SmapsEntry next_;
+  bool have_next_ = false;
+
+  // Return the next line (without '\n') or nullptr on EOF.
+  const char *NextLine(size_t *line_len) {
+    for (;;) {
+      char *start = buf_ + pos_;
+      char *nl = (char *)memchr(start, '\n', len_ - pos_);
+      if (nl) {
+        *line_len = nl - start;
+        pos_ = nl - buf_ + 1;
+        ++lines_;
+        return start;
+      }
+      if (eof_) {
+        if (pos_ == len_)
+          return nullptr;
+        *line_len = len_ - pos_;
+        pos_ = len_;
+        ++lines_;
+        return start;
+      }
+      memmove(buf_, start, len_ - pos_);
+      len_ -= pos_;
+      pos_ = 0;
+      assert(len_ < kBufSize && "smaps line does not fit into the buffer");
+      ssize_t res;
+      do {
+        res = read(fd_, buf_ + len_, kBufSize - len_);
+      } while (res < 0 && errno == EINTR);
+      if (res <= 0)
+        eof_ = true;
+      else
+        len_ += res;
+    }
+  }
+
+  static bool IsHex(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+  }
+
+  static unsigned long ParseHex(const char *&p, const char *end) {
+    unsigned long v = 0;
+    for (; p < end && IsHex(*p); ++p)
+      v = v * 16 + (*p <= '9' ? *p - '0' : *p - 'a' + 10);
+    return v;
+  }
+
+  static unsigned long ParseDec(const char *&p, const char *end) {
+    unsigned long v = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p)
+      v = v * 10 + (*p - '0');
+    return v;
+  }
+
+  static void SkipSpaces(const char *&p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t'))
+      ++p;
+  }
+
+  // Header lines start with the (lowercase hex) mapping start address, field
+  // lines start with a capitalized key.
+  static bool IsHeader(const char *line, size_t len) {
+    return len > 0 && IsHex(line[0]);
+  }
+
+  // "start-end perms offset dev inode   name"
+  void ParseHeader(const char *p, size_t len, SmapsEntry *e) {
+    const char *end = p + len;
+    memset(e, 0, sizeof(*e));
+    e->start = ParseHex(p, end);
+    assert(p < end && *p == '-');
+    ++p;
+    e->end = ParseHex(p, end);
+    assert(p + 5 < end && *p == ' ');
+    memcpy(e->perms, p + 1, 4);
+    p += 5;
+    assert(e->perms[0] == 'r' || e->perms[0] == '-');
+    assert(e->perms[1] == 'w' || e->perms[1] == '-');
+    assert(e->perms[2] == 'x' || e->perms[2] == '-');
+    if (e->perms[0] == 'r')
+      e->prot |= PROT_READ;
+    if (e->perms[1] == 'w')
+      e->prot |= PROT_WRITE;
+    if (e->perms[2] == 'x')
+      e->prot |= PROT_EXEC;
+    SkipSpaces(p, end);
+    e->offset = ParseHex(p, end);
+    SkipSpaces(p, end);
+    // Device, "major:minor" in hex.
+    ParseHex(p, end);
+    assert(p < end && *p == ':');
+    ++p;
+    ParseHex(p, end);
+    SkipSpaces(p, end);
+    e->inode = ParseDec(p, end);
+    SkipSpaces(p, end);
+
+    size_t name_len = end - p;
+    if (name_len >= kMaxName)
+      name_len = kMaxName - 1;
+    name_idx_ ^= 1;
+    memcpy(names_[name_idx_], p, name_len);
+    names_[name_idx_][name_len] = 0;
+    e->name = names_[name_idx_];
+    e->name_len = name_len;
+  }
+
+  static bool KeyIs(const char *key, size_t key_len, const char *s) {
+    return strlen(s) == key_len && memcmp(key, s, key_len) == 0;
+  }
+
+  static void ParseVmFlags(const char *p, const char *end, SmapsEntry *e) {
+    constexpr size_t kNumFlags = sizeof(kVmFlagNames) / sizeof(kVmFlagNames[0]);
+    for (;;) {
+      SkipSpaces(p, end);
+      if (p + 2 > end)
+        return;
+      for (size_t i = 0; i < kNumFlags; ++i) {
+        if (p[0] == kVmFlagNames[i][0] && p[1] == kVmFlagNames[i][1] &&
+            (p + 2 == end || p[2] == ' ')) {
+          e->vmflags |= 1ULL << i;
+          break;
+        }
+      }
+      while (p < end && *p != ' ')
+        ++p;
+    }
+  }
+
+  // "Key:   value kB"
+  void ParseField(const char *p, size_t len, SmapsEntry *e) {
+    const char *end = p + len;
+    const char *colon = (const char *)memchr(p, ':', len);
+    if (!colon)
+      return;
+    const char *key = p;
+    size_t key_len = colon - p;
+    p = colon + 1;
+    if (KeyIs(key, key_len, "VmFlags")) {
+      ParseVmFlags(p, end, e);
+      return;
+    }
+    SkipSpaces(p, end);
+    unsigned long v = ParseDec(p, end);
+
+    // Dispatch on the first letter to keep the number of comparisons low;
+    // there are a couple dozen keys and most lines are one of the first few.
+    unsigned long *field = nullptr;
+    switch (key[0]) {
+      case 'S':
+        if (KeyIs(key, key_len, "Size")) field = &e->size;
+        else if (KeyIs(key, key_len, "Shared_Clean")) field = &e->shared_clean;
+        else if (KeyIs(key, key_len, "Shared_Dirty")) field = &e->shared_dirty;
+        else if (KeyIs(key, key_len, "Swap")) field = &e->swap;
+        else if (KeyIs(key, key_len, "SwapPss")) field = &e->swap_pss;
+        else if (KeyIs(key, key_len, "ShmemPmdMapped")) field = &e->shmem_pmd_mapped;
+        else if (KeyIs(key, key_len, "Shared_Hugetlb")) field = &e->shared_hugetlb;
+        break;
+      case 'R':
+        if (KeyIs(key, key_len, "Rss")) field = &e->rss;
+        else if (KeyIs(key, key_len, "Referenced")) field = &e->referenced;
+        break;
+      case 'P':
+        if (KeyIs(key, key_len, "Pss")) field = &e->pss;
+        else if (KeyIs(key, key_len, "Pss_Dirty")) field = &e->pss_dirty;
+        else if (KeyIs(key, key_len, "Private_Clean")) field = &e->private_clean;
+        else if (KeyIs(key, key_len, "Private_Dirty")) field = &e->private_dirty;
+        else if (KeyIs(key, key_len, "Private_Hugetlb")) field = &e->private_hugetlb;
+        break;
+      case 'K':
+        if (KeyIs(key, key_len, "KernelPageSize")) field = &e->kernel_page_size;
+        break;
+      case 'M':
+        if (KeyIs(key, key_len, "MMUPageSize")) field = &e->mmu_page_size;
+        break;
+      case 'A':
+        if (KeyIs(key, key_len, "Anonymous")) field = &e->anonymous;
+        else if (KeyIs(key, key_len, "AnonHugePages")) field = &e->anon_huge_pages;
+        break;
+      case 'L':
+        if (KeyIs(key, key_len, "LazyFree")) field = &e->lazy_free;
+        else if (KeyIs(key, key_len, "Locked")) field = &e->locked;
+        break;
+      case 'F':
+        if (KeyIs(key, key_len, "FilePmdMapped")) field = &e->file_pmd_mapped;
+        break;
+      case 'T':
+        if (KeyIs(key, key_len, "THPeligible")) e->thp_eligible = v != 0;
+        break;
+    }
+    if (field)
+      *field = v;
+  }
+
+ public:
+  explicit SmapsReader(const char *path) {
+    fd_ = open(path, O_RDONLY | O_CLOEXEC);
+    buf_ = (char *)malloc(kBufSize);
+    assert(buf_);
+  }
+
+  // Reads /proc/<pid>/<file>, "smaps" by default.
+  explicit SmapsReader(int pid, const char *file = "smaps") {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, file);
+    fd_ = open(path, O_RDONLY | O_CLOEXEC);
+    buf_ = (char *)malloc(kBufSize);
+    assert(buf_);
+  }
+
+  ~SmapsReader() {
+    if (fd_ >= 0)
+      close(fd_);
+    free(buf_);
+  }
+
+  SmapsReader(const SmapsReader &) = delete;
+  SmapsReader &operator=(const SmapsReader &) = delete;
+
+  // False if the file could not be opened (e.g. the process is gone). In that
+  // case Next() reports no entries, same as for an empty file.
+  bool ok() const { return fd_ >= 0; }
+
+  // Number of lines consumed so far.
+  unsigned long lines() const { return lines_; }
+
+  // Fill in *e with the next mapping. Returns false at the end of the file.
+  bool Next(SmapsEntry *e) {
+    if (fd_ < 0)
+      return false;
+    size_t len;
+    while (!have_next_) {
+      const char *line = NextLine(&len);
+      if (!line)
+        return false;
+      if (IsHeader(line, len)) {
+        ParseHeader(line, len, &next_);
+        have_next_ = true;
+      }
+    }
+    *e = next_;
+    have_next_ = false;
+    while (const char *line = NextLine(&len)) {
+      if (IsHeader(line, len)) {
+        ParseHeader(line, len, &next_);
+        have_next_ = true;
+        break;
+      }
+      ParseField(line, len, e);
+    }
+    return true;
+  }
+};
+
+#endif  // HWADDRESS_SANITIZER_SMAPS_H
@@ -0,0 +1,192 @@
+// tagdiff: compare two dumps written by dumptags, e.g. taken before and after
+// a workload, to see how much the allocator retags.
+//
+// Usage: tagdiff [-v] [-m MiB] before after
+//   -v  list every PFN whose tags changed.
+//   -m  memory for the tags of the first dump (default: 256 MiB).
+//
+// Pages are matched by PFN. For every tagged mapping of the second dump it
+// prints how many of its present pages are
+//   new      not in the first dump,
+//   retagged in the first dump, with different tags, and
+//   stale    in the first dump, with the same tags,
+// and which fraction of the granules of the pages in both dumps was retagged.
+//
+// Both dumps are streamed in file order, which inflates each frame once. The
+// tags of the first dump are held in memory for a range of PFNs at a time; if
+// they do not fit into -m, the PFNs are compared in several passes. Beyond
+// that, the only memory used is two bytes per PFN of the second dump.
+//
+// Build: g++ -O2 tagdiff.cc -lz -o tagdiff
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "tagdump.h"
+#include "tagstats.h"
+
+// Marks a PFN of the second dump that is not in the first one.
+constexpr uint16_t kNew = 0xffff;
+
+// Index of @pfn in the PFN index of @dump, or -1.
+ssize_t find_pfn(const TagDumpReader &dump, uint64_t pfn) {
+  const PfnEntry *begin = dump.Pfns(), *end = begin + dump.NumPfns();
+  const PfnEntry *it = std::lower_bound(begin, end, PfnEntry{pfn, 0});
+  return it != end && it->pfn == pfn ? it - begin : -1;
+}
+
+// Pages of one mapping, or of all of them.
+struct DiffStats {
+  uint64_t pages = 0, fresh = 0, retagged = 0, stale = 0;
+  uint64_t changed_granules = 0;
+
+  void Add(uint16_t changed) {
+    pages++;
+    if (changed == kNew)
+      fresh++;
+    else if (changed)
+      retagged++;
+    else
+      stale++;
+    if (changed != kNew)
+      changed_granules += changed;
+  }
+
+  void Add(const DiffStats &other) {
+    pages += other.pages;
+    fresh += other.fresh;
+    retagged += other.retagged;
+    stale += other.stale;
+    changed_granules += other.changed_granules;
+  }
+
+  void Print() const {
+    printf("%" PRIu64 " pages, %" PRIu64 " new, %" PRIu64 " retagged, %" PRIu64
+           " stale",
+           pages, fresh, retagged, stale);
+    if (uint64_t compared = retagged + stale)
+      printf(", %.2f%% of granules retagged",
+             100.0 * changed_granules / (compared * kTagDumpTagsPerPage));
+    printf("\n");
+  }
+};
+
+int main(int argc, char **argv) {
+  bool verbose = false;
+  size_t budget = 256 << 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "vm:")) != -1) {
+    switch (opt) {
+      case 'v':
+        verbose = true;
+        break;
+      case 'm':
+        budget = std::max(1ul, strtoul(optarg, nullptr, 10)) << 20;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-v] [-m MiB] before after\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind + 2 != argc) {
+    fprintf(stderr, "usage: %s [-v] [-m MiB] before after\n", argv[0]);
+    return 1;
+  }
+  TagDumpReader before, after;
+  for (auto [dump, path] : {std::pair{&before, argv[optind]},
+                            std::pair{&after, argv[optind + 1]}}) {
+    if (!dump->Open(path)) {
+      fprintf(stderr, "%s: not a complete tag dump\n", path);
+      return 1;
+    }
+  }
+
+  // The number of granules retagged, or kNew, for every PFN of the second
+  // dump, in the order of its index.
+  std::vector<uint16_t> changes(after.NumPfns(), kNew);
+
+  // Each pass loads the tags of a range of the first dump's PFN index, and
+  // compares the blocks of the second dump that fall into it.
+  size_t per_pass = std::max<size_t>(1, budget / kTagDumpTagsPerPage);
+  per_pass = std::min(per_pass, before.NumPfns());
+  std::vector<uint8_t> tags(per_pass * kTagDumpTagsPerPage);
+  const PfnEntry *pfns = before.Pfns();
+  unsigned passes = 0;
+  for (size_t first = 0; first < before.NumPfns(); first += per_pass) {
+    size_t last = std::min(first + per_pass, before.NumPfns()) - 1;
+    uint64_t lo = pfns[first].pfn, hi = pfns[last].pfn;
+    passes++;
+    bool ok = before.ForEachBlock([&](const BlockRecord &b, const uint8_t *t) {
+      if (b.pfn < lo || b.pfn > hi)
+        return true;
+      size_t i = find_pfn(before, b.pfn) - first;
+      memcpy(&tags[i * kTagDumpTagsPerPage], t, kTagDumpTagsPerPage);
+      return true;
+    });
+    ok = ok && after.ForEachBlock([&](const BlockRecord &b, const uint8_t *t) {
+      if (b.pfn < lo || b.pfn > hi)
+        return true;
+      ssize_t i = find_pfn(before, b.pfn);
+      if (i < 0)
+        return true;
+      unsigned changed =
+          CountTagChanges(&tags[(i - first) * kTagDumpTagsPerPage], t);
+      changes[find_pfn(after, b.pfn)] = changed;
+      if (verbose && changed)
+        printf("pfn %" PRIx64 " (pid %u at %" PRIx64 "): %u granules retagged\n",
+               b.pfn, b.pid, b.addr, changed);
+      return true;
+    });
+    if (!ok) {
+      fprintf(stderr, "corrupt dump\n");
+      return 1;
+    }
+  }
+
+  // Attribute the PFNs to the mappings they are present in, as recorded in
+  // the address index of the second dump.
+  DiffStats total;
+  const AddrEntry *addrs = after.Addrs(), *addrs_end = addrs + after.NumAddrs();
+  after.ForEachRecord([&](uint64_t, const RecordHeader &r, const char *payload) {
+    if (r.type != kRecordMapping)
+      return true;
+    MappingRecord m;
+    std::string_view name = TagDumpReader::Parse(r, payload, &m);
+    DiffStats stats;
+    for (const AddrEntry *it =
+             std::lower_bound(addrs, addrs_end, AddrEntry{m.pid, 0, m.start, 0});
+         it != addrs_end && it->pid == m.pid && it->addr < m.end; ++it) {
+      ssize_t i = find_pfn(after, it->pfn);
+      if (i >= 0)
+        stats.Add(changes[i]);
+    }
+    if (!stats.pages)
+      return true;
+    printf("pid %u %" PRIx64 "-%" PRIx64 " %.*s: ", m.pid, m.start, m.end,
+           (int)name.size(), name.data());
+    stats.Print();
+    total.Add(stats);
+    return true;
+  });
+
+  // PFNs of the first dump missing from the second: freed, or no longer
+  // tagged.
+  uint64_t gone = 0;
+  const PfnEntry *b = before.Pfns(), *b_end = b + before.NumPfns();
+  const PfnEntry *a = after.Pfns(), *a_end = a + after.NumPfns();
+  for (; b != b_end; ++b) {
+    while (a != a_end && a->pfn < b->pfn)
+      ++a;
+    gone += a == a_end || a->pfn != b->pfn;
+  }
+
+  printf("total: ");
+  total.Print();
+  printf("%" PRIu64 " PFNs only in %s; compared in %u passes\n", gone,
+         argv[optind], passes);
+}
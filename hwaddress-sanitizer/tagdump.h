@@ -0,0 +1,460 @@
+// tagdump.h: file format written by dumptags, and a reader for it.
+//
+// A dump is a header, a sequence of self-describing records, and an index:
+//
+//   TagDumpHeader
+//   Record*      process, mapping and block records, in any order
+//   TagDumpIndex PfnEntry[num_pfns] AddrEntry[num_addrs]
+//
+// Every record starts with a RecordHeader giving its type and payload size, so
+// the records can be walked without the index. Records written by different
+// dumper threads may be interleaved, which is why each one carries its pid.
+//
+// A block holds the tags of one physical page, each PFN is dumped once. The
+// tags are stored with whichever of the TagEncodings is smallest for the page;
+// most pages are a single tag or a few long runs, and the rest still only need
+// 4 bits per tag.
+//
+// Blocks may also be grouped into zlib-compressed frames (dumptags -z). A frame
+// record inflates to a sequence of block records, and the index entries of its
+// blocks point at the frame.
+//
+// The index is written last and located by TagDumpHeader::index_offset. It
+// has the block of every dumped PFN, sorted by PFN, and the PFN of every
+// present page of every dumped mapping, sorted by (pid, address); a page whose
+// PFN was dumped before, under another process or address, is found through
+// the PFN entry of the original block. Both lookups are binary searches over
+// the mmap()ed file.
+//
+// Build users of TagDumpReader with -lz.
+//
+//   TagDumpReader dump;
+//   uint8_t tags[kTagDumpTagsPerPage];
+//   if (dump.Open(path) && dump.Lookup(pid, addr, tags))
+//     printf("tag of %lx: %x\n", addr, tags[addr % 4096 / 16]);
+//
+// All integers are in host byte order, i.e. little-endian on arm64.
+
+#ifndef HWADDRESS_SANITIZER_TAGDUMP_H
+#define HWADDRESS_SANITIZER_TAGDUMP_H
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
+constexpr char kTagDumpMagic[8] = {'T', 'A', 'G', 'D', 'U', 'M', 'P', 0};
+// Version 2 added kTagsPacked and frames.
+constexpr uint32_t kTagDumpVersion = 2;
+constexpr uint64_t kTagDumpPageSize = 4096;
+// One tag per 16-byte granule, stored in the low 4 bits of a byte.
+constexpr uint64_t kTagDumpTagsPerPage = kTagDumpPageSize / 16;
+
+struct TagDumpHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  // Both 0 if the dump did not complete. The index is 8-byte aligned, so
+  // there may be padding between the end of the records and the index.
+  uint64_t records_end;
+  uint64_t index_offset;
+};
+
+enum RecordType : uint8_t {
+  kRecordProcess = 1,  // ProcessRecord, then the exe path.
+  kRecordMapping = 2,  // MappingRecord, then the mapping name.
+  kRecordBlock = 3,    // BlockRecord, then the encoded tags.
+  kRecordFrame = 4,    // FrameRecord, then zlib data: block records.
+};
+
+enum TagEncoding : uint8_t {
+  kTagsRaw = 0,   // kTagDumpTagsPerPage bytes.
+  kTagsFill = 1,  // One byte: every granule has this tag.
+  kTagsRle = 2,   // (run length - 1, tag) byte pairs.
+  kTagsPacked = 3,  // Two tags per byte, the first in the low nibble.
+};
+
+struct RecordHeader {
+  uint8_t type;
+  uint8_t encoding;  // TagEncoding, for blocks.
+  uint16_t reserved;
+  // Bytes following the header, including the fixed-size part.
+  uint32_t size;
+};
+
+struct ProcessRecord {
+  uint32_t pid;
+  uint32_t reserved;
+};
+
+struct MappingRecord {
+  uint32_t pid;
+  uint32_t reserved;
+  uint64_t start, end;
+};
+
+struct BlockRecord {
+  uint32_t pid;
+  uint32_t reserved;
+  // The first page this PFN was found at.
+  uint64_t addr;
+  uint64_t pfn;
+};
+
+struct FrameRecord {
+  // Size of the inflated block records.
+  uint32_t raw_size;
+  uint32_t num_blocks;
+};
+
+struct TagDumpIndex {
+  uint64_t num_pfns;
+  uint64_t num_addrs;
+};
+
+struct PfnEntry {
+  uint64_t pfn;
+  // File offset of the RecordHeader of the block, or of the frame holding it.
+  uint64_t offset;
+
+  bool operator<(const PfnEntry &other) const { return pfn < other.pfn; }
+};
+
+struct AddrEntry {
+  uint32_t pid;
+  uint32_t reserved;
+  uint64_t addr;
+  uint64_t pfn;
+
+  bool operator<(const AddrEntry &other) const {
+    return pid != other.pid ? pid < other.pid : addr < other.addr;
+  }
+};
+
+// Encode the tags of a page into @out, which must have room for
+// kTagDumpTagsPerPage bytes. Returns the encoding and sets @size.
+inline TagEncoding EncodeTags(const uint8_t *tags, uint8_t *out,
+                              uint32_t *size) {
+  size_t runs = 1;
+  uint8_t high_bits = tags[0] & 0xf0;
+  for (size_t i = 1; i < kTagDumpTagsPerPage; ++i) {
+    runs += tags[i] != tags[i - 1];
+    high_bits |= tags[i] & 0xf0;
+  }
+  if (runs == 1) {
+    out[0] = tags[0];
+    *size = 1;
+    return kTagsFill;
+  }
+  if (runs * 2 >= kTagDumpTagsPerPage / 2 && !high_bits) {
+    for (size_t i = 0; i < kTagDumpTagsPerPage / 2; ++i)
+      out[i] = tags[2 * i] | tags[2 * i + 1] << 4;
+    *size = kTagDumpTagsPerPage / 2;
+    return kTagsPacked;
+  }
+  if (runs * 2 >= kTagDumpTagsPerPage) {
+    memcpy(out, tags, kTagDumpTagsPerPage);
+    *size = kTagDumpTagsPerPage;
+    return kTagsRaw;
+  }
+  uint8_t *p = out;
+  for (size_t i = 0; i < kTagDumpTagsPerPage;) {
+    size_t j = i + 1;
+    while (j < kTagDumpTagsPerPage && tags[j] == tags[i])
+      ++j;
+    // Runs are at most kTagDumpTagsPerPage == 256 long.
+    *p++ = j - i - 1;
+    *p++ = tags[i];
+    i = j;
+  }
+  *size = p - out;
+  return kTagsRle;
+}
+
+// The inverse of EncodeTags(). Returns false if the data is malformed.
+inline bool DecodeTags(TagEncoding encoding, const uint8_t *data, uint32_t size,
+                       uint8_t *tags) {
+  switch (encoding) {
+    case kTagsRaw:
+      if (size != kTagDumpTagsPerPage)
+        return false;
+      memcpy(tags, data, kTagDumpTagsPerPage);
+      return true;
+    case kTagsFill:
+      if (size != 1)
+        return false;
+      memset(tags, data[0], kTagDumpTagsPerPage);
+      return true;
+    case kTagsRle: {
+      size_t n = 0;
+      for (uint32_t i = 0; i + 1 < size; i += 2) {
+        size_t run = data[i] + 1;
+        if (n + run > kTagDumpTagsPerPage)
+          return false;
+        memset(tags + n, data[i + 1], run);
+        n += run;
+      }
+      return n == kTagDumpTagsPerPage && size % 2 == 0;
+    }
+    case kTagsPacked:
+      if (size != kTagDumpTagsPerPage / 2)
+        return false;
+      for (size_t i = 0; i < kTagDumpTagsPerPage / 2; ++i) {
+        tags[2 * i] = data[i] & 0xf;
+        tags[2 * i + 1] = data[i] >> 4;
+      }
+      return true;
+  }
+  return false;
+}
+
+// Compress @size bytes at @data into a frame record appended to @out.
+inline void AppendFrame(const char *data, size_t size, uint32_t num_blocks,
+                        std::vector<char> *out) {
+  uLongf compressed = compressBound(size);
+  size_t start = out->size();
+  out->resize(start + sizeof(RecordHeader) + sizeof(FrameRecord) + compressed);
+  char *payload = out->data() + start + sizeof(RecordHeader);
+  int res = compress2((Bytef *)payload + sizeof(FrameRecord), &compressed,
+                      (const Bytef *)data, size, Z_DEFAULT_COMPRESSION);
+  assert(res == Z_OK);
+  (void)res;
+  RecordHeader h = {kRecordFrame, 0, 0,
+                    (uint32_t)(sizeof(FrameRecord) + compressed)};
+  FrameRecord f = {(uint32_t)size, num_blocks};
+  memcpy(out->data() + start, &h, sizeof(h));
+  memcpy(payload, &f, sizeof(f));
+  out->resize(start + sizeof(RecordHeader) + h.size);
+}
+
+// Read-only view of a complete dump, mmap()ed in full. Not thread-safe: the
+// last inflated frame is cached.
+class TagDumpReader {
+  const char *data = nullptr;
+  size_t size = 0;
+  const PfnEntry *pfns = nullptr;
+  const AddrEntry *addrs = nullptr;
+  size_t num_pfns = 0, num_addrs = 0;
+  mutable std::vector<char> frame;
+  mutable uint64_t frame_offset = 0;
+
+  // Records are not aligned, so they are copied out rather than cast to.
+  static bool RecordAt(const char *data, size_t size, uint64_t offset,
+                       RecordHeader *r) {
+    if (offset + sizeof(RecordHeader) > size)
+      return false;
+    memcpy(r, data + offset, sizeof(*r));
+    return offset + sizeof(RecordHeader) + r->size <= size;
+  }
+  bool RecordAt(uint64_t offset, RecordHeader *r) const {
+    return RecordAt(data, size, offset, r);
+  }
+
+  static bool DecodeBlock(const RecordHeader &r, const char *payload,
+                          uint8_t *tags, BlockRecord *block) {
+    if (r.type != kRecordBlock || r.size < sizeof(BlockRecord))
+      return false;
+    memcpy(block, payload, sizeof(BlockRecord));
+    return DecodeTags((TagEncoding)r.encoding,
+                      (const uint8_t *)payload + sizeof(BlockRecord),
+                      r.size - sizeof(BlockRecord), tags);
+  }
+
+  // Inflate the frame record at @offset into @frame, unless it is there
+  // already.
+  bool Inflate(uint64_t offset, const RecordHeader &r) const {
+    if (frame_offset == offset)
+      return true;
+    FrameRecord f;
+    if (r.size < sizeof(f))
+      return false;
+    const char *payload = data + offset + sizeof(RecordHeader);
+    memcpy(&f, payload, sizeof(f));
+    frame.resize(f.raw_size);
+    uLongf raw_size = f.raw_size;
+    if (uncompress((Bytef *)frame.data(), &raw_size,
+                   (const Bytef *)payload + sizeof(f),
+                   r.size - sizeof(f)) != Z_OK ||
+        raw_size != f.raw_size) {
+      frame_offset = 0;
+      return false;
+    }
+    frame_offset = offset;
+    return true;
+  }
+
+  // Call f(const BlockRecord &, const uint8_t *tags) for the blocks in the
+  // record sequence data[0, size).
+  template <typename F>
+  static bool ForEachBlockIn(const char *data, size_t size, F f) {
+    uint8_t tags[kTagDumpTagsPerPage];
+    for (uint64_t offset = 0; offset < size;) {
+      RecordHeader r;
+      BlockRecord block;
+      if (!RecordAt(data, size, offset, &r) ||
+          !DecodeBlock(r, data + offset + sizeof(r), tags, &block) ||
+          !f(block, tags))
+        return false;
+      offset += sizeof(r) + r.size;
+    }
+    return true;
+  }
+
+ public:
+  TagDumpReader() = default;
+  TagDumpReader(const TagDumpReader &) = delete;
+  TagDumpReader &operator=(const TagDumpReader &) = delete;
+  ~TagDumpReader() {
+    if (data)
+      munmap((void *)data, size);
+  }
+
+  // Map the dump at @path. Returns false if it cannot be read, or is not a
+  // complete dump of a version this reader understands.
+  bool Open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TagDumpHeader)) {
+      close(fd);
+      return false;
+    }
+    size = st.st_size;
+    void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+      return false;
+    data = (const char *)p;
+
+    const TagDumpHeader &h = header();
+    if (memcmp(h.magic, kTagDumpMagic, sizeof(h.magic)) ||
+        h.version != kTagDumpVersion || h.page_size != kTagDumpPageSize ||
+        h.index_offset == 0 || h.index_offset % 8 ||
+        h.records_end > h.index_offset ||
+        h.index_offset + sizeof(TagDumpIndex) > size)
+      return false;
+    const TagDumpIndex *index = (const TagDumpIndex *)(data + h.index_offset);
+    uint64_t entries = h.index_offset + sizeof(TagDumpIndex);
+    if (index->num_pfns > size / sizeof(PfnEntry) ||
+        index->num_addrs > size / sizeof(AddrEntry) ||
+        entries + index->num_pfns * sizeof(PfnEntry) +
+                index->num_addrs * sizeof(AddrEntry) > size)
+      return false;
+    num_pfns = index->num_pfns;
+    num_addrs = index->num_addrs;
+    pfns = (const PfnEntry *)(data + entries);
+    addrs = (const AddrEntry *)(pfns + num_pfns);
+    return true;
+  }
+
+  const TagDumpHeader &header() const { return *(const TagDumpHeader *)data; }
+
+  // The index: every dumped PFN, sorted.
+  const PfnEntry *Pfns() const { return pfns; }
+  size_t NumPfns() const { return num_pfns; }
+  // Every present page of every dumped mapping, sorted by (pid, addr).
+  const AddrEntry *Addrs() const { return addrs; }
+  size_t NumAddrs() const { return num_addrs; }
+
+  // Decode the block of @pfn, whose record (or frame) is at @offset, into
+  // @tags (kTagDumpTagsPerPage bytes), and optionally return its BlockRecord.
+  bool ReadBlock(uint64_t offset, uint64_t pfn, uint8_t *tags,
+                 BlockRecord *block = nullptr) const {
+    BlockRecord b;
+    if (!block)
+      block = &b;
+    RecordHeader r;
+    if (!RecordAt(offset, &r))
+      return false;
+    if (r.type == kRecordBlock)
+      return DecodeBlock(r, data + offset + sizeof(r), tags, block) &&
+             block->pfn == pfn;
+    if (r.type != kRecordFrame || !Inflate(offset, r))
+      return false;
+    bool found = false;
+    ForEachBlockIn(frame.data(), frame.size(),
+                   [&](const BlockRecord &frame_block, const uint8_t *t) {
+                     if (frame_block.pfn != pfn)
+                       return true;
+                     *block = frame_block;
+                     memcpy(tags, t, kTagDumpTagsPerPage);
+                     found = true;
+                     return false;
+                   });
+    return found;
+  }
+
+  bool LookupPfn(uint64_t pfn, uint8_t *tags) const {
+    const PfnEntry *it =
+        std::lower_bound(pfns, pfns + num_pfns, PfnEntry{pfn, 0});
+    if (it == pfns + num_pfns || it->pfn != pfn)
+      return false;
+    return ReadBlock(it->offset, pfn, tags);
+  }
+
+  // The tags of the page containing @addr in process @pid.
+  bool Lookup(uint32_t pid, uint64_t addr, uint8_t *tags) const {
+    AddrEntry key = {pid, 0, addr & ~(kTagDumpPageSize - 1), 0};
+    const AddrEntry *it = std::lower_bound(addrs, addrs + num_addrs, key);
+    if (it == addrs + num_addrs || it->pid != key.pid || it->addr != key.addr)
+      return false;
+    return LookupPfn(it->pfn, tags);
+  }
+
+  // Call f(uint64_t offset, const RecordHeader &, const char *payload) for
+  // every record, in file order; the payload is not aligned. Stops early and
+  // returns false if f returns false or a record is truncated.
+  template <typename F>
+  bool ForEachRecord(F f) const {
+    uint64_t end = header().records_end;
+    for (uint64_t offset = sizeof(TagDumpHeader); offset < end;) {
+      RecordHeader r;
+      if (!RecordAt(offset, &r) ||
+          !f(offset, r, data + offset + sizeof(RecordHeader)))
+        return false;
+      offset += sizeof(RecordHeader) + r.size;
+    }
+    return true;
+  }
+
+  // Call f(const BlockRecord &, const uint8_t *tags) for every block, in file
+  // order, inflating frames as they come. Stops early and returns false if f
+  // returns false or the dump is corrupt.
+  template <typename F>
+  bool ForEachBlock(F f) const {
+    uint8_t tags[kTagDumpTagsPerPage];
+    return ForEachRecord([&](uint64_t offset, const RecordHeader &r,
+                             const char *payload) {
+      if (r.type == kRecordBlock) {
+        BlockRecord block;
+        return DecodeBlock(r, payload, tags, &block) && f(block, tags);
+      }
+      if (r.type == kRecordFrame)
+        return Inflate(offset, r) &&
+               ForEachBlockIn(frame.data(), frame.size(), f);
+      return true;
+    });
+  }
+
+  // Copy out the fixed-size part of a record payload (ProcessRecord, ...),
+  // and return the variable-length rest: the exe path or the mapping name.
+  template <typename Fixed>
+  static std::string_view Parse(const RecordHeader &r, const char *payload,
+                                Fixed *fixed) {
+    if (r.size < sizeof(Fixed))
+      return {};
+    memcpy(fixed, payload, sizeof(Fixed));
+    return std::string_view(payload + sizeof(Fixed), r.size - sizeof(Fixed));
+  }
+};
+
+#endif  // HWADDRESS_SANITIZER_TAGDUMP_H
@@ -0,0 +1,189 @@
+// tagstats.h: statistics over MTE tags, one page of tags at a time.
+//
+// TagStats::AddPage() takes the kTagsPerPage tags of a page (one byte per
+// 16-byte granule, as returned by PTRACE_PEEKMTETAGS) and counts
+//   - how many granules carry each of the 16 tags, and
+//   - how many pairs of neighbouring granules carry the same tag. A linear
+//     overflow from one granule into the next is only caught if the tags
+//     differ, so this is the rate at which such overflows would go
+//     undetected, with the caveat that most equal pairs are simply two
+//     granules of the same allocation.
+// Pairs straddling two pages are not counted: the pages need not be adjacent.
+//
+// The counting is vectorized with NEON on arm64 and SSE2 on x86-64, so that it
+// keeps up with PTRACE_PEEKMTETAGS; the scalar version is the reference.
+// CountTagChanges() compares the tags of two pages the same way, for tagdiff.
+
+#ifndef HWADDRESS_SANITIZER_TAGSTATS_H
+#define HWADDRESS_SANITIZER_TAGSTATS_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+struct TagStats {
+  static constexpr size_t kTagsPerPage = 4096 / 16;
+  static constexpr unsigned kNumTags = 16;
+
+  uint64_t pages = 0;
+  uint64_t hist[kNumTags] = {};
+  uint64_t adjacent_pairs = 0;
+  uint64_t adjacent_equal = 0;
+
+  void AddPage(const uint8_t *tags) {
+    pages++;
+    adjacent_pairs += kTagsPerPage - 1;
+#if defined(__aarch64__)
+    AddPageNeon(tags);
+#elif defined(__SSE2__)
+    AddPageSse2(tags);
+#else
+    AddPageScalar(tags);
+#endif
+  }
+
+  void AddPageScalar(const uint8_t *tags) {
+    for (size_t i = 0; i < kTagsPerPage; ++i)
+      hist[tags[i] & 0xf]++;
+    for (size_t i = 0; i + 1 < kTagsPerPage; ++i)
+      adjacent_equal += (tags[i] & 0xf) == (tags[i + 1] & 0xf);
+  }
+
+#if defined(__aarch64__)
+  // Each 8-bit lane counts at most kTagsPerPage / 16 == 16 matches per page,
+  // so the per-page counters cannot overflow.
+  void AddPageNeon(const uint8_t *tags) {
+    const uint8x16_t mask = vdupq_n_u8(0xf);
+    uint8x16_t v[kTagsPerPage / 16];
+    for (size_t i = 0; i < kTagsPerPage / 16; ++i)
+      v[i] = vandq_u8(vld1q_u8(tags + i * 16), mask);
+    for (unsigned t = 0; t < kNumTags; ++t) {
+      uint8x16_t tag = vdupq_n_u8(t), acc = vdupq_n_u8(0);
+      for (size_t i = 0; i < kTagsPerPage / 16; ++i)
+        acc = vsubq_u8(acc, vceqq_u8(v[i], tag));
+      hist[t] += vaddlvq_u8(acc);
+    }
+    // Compare every granule with the next one; the pairs within the last
+    // vector are counted one by one.
+    uint8x16_t acc = vdupq_n_u8(0);
+    for (size_t i = 0; i + 1 < kTagsPerPage / 16; ++i)
+      acc = vsubq_u8(acc, vceqq_u8(v[i], vextq_u8(v[i], v[i + 1], 1)));
+    adjacent_equal += vaddlvq_u8(acc);
+    const uint8_t *last = tags + kTagsPerPage - 16;
+    for (size_t i = 0; i < 15; ++i)
+      adjacent_equal += (last[i] & 0xf) == (last[i + 1] & 0xf);
+  }
+#elif defined(__SSE2__)
+  static uint64_t Sum(__m128i acc) {
+    __m128i sums = _mm_sad_epu8(acc, _mm_setzero_si128());
+    return _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+  }
+
+  // Each 8-bit lane counts at most kTagsPerPage / 16 == 16 matches per page,
+  // so the per-page counters cannot overflow.
+  void AddPageSse2(const uint8_t *tags) {
+    const __m128i mask = _mm_set1_epi8(0xf);
+    __m128i v[kTagsPerPage / 16];
+    for (size_t i = 0; i < kTagsPerPage / 16; ++i)
+      v[i] = _mm_and_si128(_mm_loadu_si128((const __m128i *)(tags + i * 16)),
+                           mask);
+    for (unsigned t = 0; t < kNumTags; ++t) {
+      __m128i tag = _mm_set1_epi8(t), acc = _mm_setzero_si128();
+      for (size_t i = 0; i < kTagsPerPage / 16; ++i)
+        acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v[i], tag));
+      hist[t] += Sum(acc);
+    }
+    __m128i acc = _mm_setzero_si128();
+    for (size_t i = 0; i + 1 < kTagsPerPage / 16; ++i) {
+      __m128i next = _mm_and_si128(
+          _mm_loadu_si128((const __m128i *)(tags + i * 16 + 1)), mask);
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v[i], next));
+    }
+    adjacent_equal += Sum(acc);
+    const uint8_t *last = tags + kTagsPerPage - 16;
+    for (size_t i = 0; i < 15; ++i)
+      adjacent_equal += (last[i] & 0xf) == (last[i + 1] & 0xf);
+  }
+#endif
+
+  void Add(const TagStats &other) {
+    pages += other.pages;
+    for (unsigned t = 0; t < kNumTags; ++t)
+      hist[t] += other.hist[t];
+    adjacent_pairs += other.adjacent_pairs;
+    adjacent_equal += other.adjacent_equal;
+  }
+
+  uint64_t Granules() const { return pages * kTagsPerPage; }
+
+  // Shannon entropy of the tag distribution, in bits (at most 4).
+  double Entropy() const {
+    double entropy = 0;
+    for (unsigned t = 0; t < kNumTags; ++t) {
+      if (!hist[t])
+        continue;
+      double p = (double)hist[t] / Granules();
+      entropy -= p * log2(p);
+    }
+    return entropy;
+  }
+
+  // One line: zero-tagged fraction, adjacent collision rate, entropy and the
+  // histogram in percent.
+  std::string Format() const {
+    if (!pages)
+      return "no pages";
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf),
+                     "%lu pages, %.1f%% zero, %.2f%% adjacent equal, "
+                     "%.2f bits |",
+                     (unsigned long)pages, 100.0 * hist[0] / Granules(),
+                     100.0 * adjacent_equal / adjacent_pairs, Entropy());
+    std::string s(buf, n);
+    for (unsigned t = 0; t < kNumTags; ++t) {
+      n = snprintf(buf, sizeof(buf), " %.1f", 100.0 * hist[t] / Granules());
+      s.append(buf, n);
+    }
+    return s;
+  }
+};
+
+// The number of granules whose tags differ between the pages of tags @a and @b.
+inline unsigned CountTagChangesScalar(const uint8_t *a, const uint8_t *b) {
+  unsigned changed = 0;
+  for (size_t i = 0; i < TagStats::kTagsPerPage; ++i)
+    changed += (a[i] & 0xf) != (b[i] & 0xf);
+  return changed;
+}
+
+inline unsigned CountTagChanges(const uint8_t *a, const uint8_t *b) {
+#if defined(__aarch64__)
+  const uint8x16_t mask = vdupq_n_u8(0xf);
+  uint8x16_t equal = vdupq_n_u8(0);
+  for (size_t i = 0; i < TagStats::kTagsPerPage; i += 16)
+    equal = vsubq_u8(equal, vceqq_u8(vandq_u8(vld1q_u8(a + i), mask),
+                                     vandq_u8(vld1q_u8(b + i), mask)));
+  return TagStats::kTagsPerPage - vaddlvq_u8(equal);
+#elif defined(__SSE2__)
+  const __m128i mask = _mm_set1_epi8(0xf);
+  __m128i equal = _mm_setzero_si128();
+  for (size_t i = 0; i < TagStats::kTagsPerPage; i += 16) {
+    __m128i x = _mm_and_si128(_mm_loadu_si128((const __m128i *)(a + i)), mask);
+    __m128i y = _mm_and_si128(_mm_loadu_si128((const __m128i *)(b + i)), mask);
+    equal = _mm_sub_epi8(equal, _mm_cmpeq_epi8(x, y));
+  }
+  return TagStats::kTagsPerPage - TagStats::Sum(equal);
+#else
+  return CountTagChangesScalar(a, b);
+#endif
+}
+
+#endif  // HWADDRESS_SANITIZER_TAGSTATS_H